@@ -0,0 +1,173 @@
+/*============================================================================
+
+  bench.cpp
+
+  Copyright (c)2020-1 Kevin Boone, GPL v3.0
+
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#include "bench.h"
+#include "threadpool.h"
+#include "framebuffer.h"
+
+// Keep stepping each grid until at least this many seconds have passed,
+//   and at least BENCH_MIN_STEPS steps have been run
+#define BENCH_MIN_SECONDS 1.0
+#define BENCH_MIN_STEPS 3
+
+// The grid sizes that bench_render() draws, as cubes
+static const int bench_render_sizes[] = { 8, 16, 32 };
+
+/*===========================================================================
+
+  now
+
+  Monotonic time in seconds
+
+===========================================================================*/
+static double now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+/*===========================================================================
+
+  time_steps
+
+  Seed a grid, and return the mean time for one step, in milliseconds.
+  Every grid of the same size is seeded with the same cells, so the 
+  final population can be used to check that the methods agree.
+
+===========================================================================*/
+static double time_steps (int size, double filling, const Life3DRule &rule,
+    Life3DBoundary boundary, Life3DCounting counting, ThreadPool *pool,
+    int *steps, long *population)
+  {
+  Life3D life3D (size, size, size, filling, LIFE3D_ENGINE_DENSE, boundary);
+  life3D.set_thread_pool (pool);
+  life3D.set_rule (rule);
+  life3D.set_counting (counting);
+  srand (size);
+  life3D.seed();
+
+  int n = 0;
+  double start = now();
+  double elapsed = 0;
+  // When steps is not zero, run exactly that many steps, so that
+  //   the populations can be compared
+  while (*steps ? n < *steps : 
+         (elapsed < BENCH_MIN_SECONDS || n < BENCH_MIN_STEPS))
+    {
+    life3D.step();
+    n++;
+    elapsed = now() - start;
+    }
+  *steps = n;
+  *population = (long)life3D.get_population();
+  return elapsed * 1000 / n;
+  }
+
+/*===========================================================================
+
+  bench_counting
+
+===========================================================================*/
+void bench_counting (int threads, double filling, const Life3DRule &rule,
+       Life3DBoundary boundary)
+  {
+  ThreadPool pool (threads);
+  printf ("Dense engine, %d thread(s), ms per step\n", 
+    pool.get_threads());
+  printf ("%6s %12s %12s %8s\n", "size", "direct", "separable", "speedup");
+  for (int size = 16; size <= 256; size *= 2)
+    {
+    int steps = 0;
+    long direct_pop, separable_pop;
+    double direct = time_steps (size, filling, rule, boundary, 
+      LIFE3D_COUNTING_DIRECT, &pool, &steps, &direct_pop);
+    double separable = time_steps (size, filling, rule, boundary,
+      LIFE3D_COUNTING_SEPARABLE, &pool, &steps, &separable_pop);
+    printf ("%6d %12.3f %12.3f %7.2fx\n", size, direct, separable, 
+      direct / separable);
+    if (direct_pop != separable_pop)
+      printf ("  Results differ after %d steps: %ld and %ld cells alive\n", 
+        steps, direct_pop, separable_pop);
+    fflush (stdout);
+    }
+  }
+
+
+/*===========================================================================
+
+  mean
+
+===========================================================================*/
+static double mean (const std::vector<double> &v)
+  {
+  double sum = 0;
+  for (size_t i = 0; i < v.size(); i++)
+    sum += v[i];
+  return v.empty() ? 0 : sum / v.size();
+  }
+
+/*===========================================================================
+
+  percentile
+
+  The smallest value that at least p per cent of the values do not
+  exceed. v is sorted.
+
+===========================================================================*/
+static double percentile (std::vector<double> &v, int p)
+  {
+  if (v.empty()) return 0;
+  std::sort (v.begin(), v.end());
+  size_t rank = (v.size() * p + 99) / 100;
+  return v[rank > 0 ? rank - 1 : 0];
+  }
+
+/*===========================================================================
+
+  bench_render
+
+===========================================================================*/
+void bench_render (int generations, int pixels, int threads, 
+       double filling, Life3DEngine engine, int leap, size_t cache_limit,
+       const Life3DRule &rule, Life3DBoundary boundary, 
+       Life3DCounting counting, Life3DRenderer renderer, bool adaptive)
+  {
+  FrameBuffer *fb = framebuffer_create_virtual (pixels, pixels, 32);
+  printf ("%d generations, %dx%d pixels, times in ms\n", generations, 
+    pixels, pixels);
+  printf ("%6s %2s %8s %8s %8s %8s %8s %8s %8s\n", "size", "q", "gens/s",
+    "draw", "draw p50", "draw p99", "step", "step p50", "step p99");
+  int sizes = sizeof (bench_render_sizes) / sizeof (bench_render_sizes[0]);
+  for (int i = 0; i < sizes; i++)
+    {
+    int size = bench_render_sizes[i];
+    for (int q = 1; q <= 4; q++)
+      {
+      Life3DRunner runner (fb, size, size, size, pixels, 1.0, q, 
+        generations, 0, filling, engine, threads, leap, cache_limit, rule, 
+        boundary, counting, LIFE3D_CYCLE_IGNORE, renderer, adaptive, 
+        NULL);
+      std::vector<double> render_ms, step_ms;
+      runner.bench (generations, step_ms, render_ms);
+      double total = mean (render_ms) + mean (step_ms);
+      printf ("%6d %2d %8.2f %8.2f %8.2f %8.2f %8.3f %8.3f %8.3f\n", 
+        size, q, total > 0 ? 1000 / total : 0, 
+        mean (render_ms), percentile (render_ms, 50), 
+        percentile (render_ms, 99), mean (step_ms), 
+        percentile (step_ms, 50), percentile (step_ms, 99));
+      fflush (stdout);
+      }
+    }
+  framebuffer_destroy (fb);
+  }
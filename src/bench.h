@@ -0,0 +1,37 @@
+/*============================================================================
+
+  bench.h
+
+  Copyright (c)2020-1 Kevin Boone, GPL v3.0
+
+  Benchmarks that run without the framebuffer, and print their 
+  results to stdout.
+
+============================================================================*/
+#pragma once
+
+#include "life3d.h"
+#include "life3drunner.h"
+
+// The width and height of the picture for bench_render(), if the 
+//   command line does not give one
+#define BENCH_PIXELS 256
+
+/** Time the dense engine's neighbour counting methods against one
+    another, at grid sizes from 16 to 256, using the given number of
+    threads (0 for one per CPU), initial filling, rule, and boundary. */
+void bench_counting (int threads, double filling, const Life3DRule &rule,
+       Life3DBoundary boundary);
+
+/** Run the game for the given number of generations, drawing on a 
+    virtual framebuffer pixels square, at each of several grid sizes
+    and every anti-aliasing quality. For each, print the generations
+    drawn per second, and the mean, median and 99th percentile times
+    to draw and to step a generation. The pattern is the same every 
+    time for each grid size. The other arguments are as for 
+    Life3DRunner. */
+void bench_render (int generations, int pixels, int threads, 
+       double filling, Life3DEngine engine, int leap, size_t cache_limit,
+       const Life3DRule &rule, Life3DBoundary boundary, 
+       Life3DCounting counting, Life3DRenderer renderer, bool adaptive);
+
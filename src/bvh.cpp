@@ -0,0 +1,314 @@
+/*============================================================================
+
+  bvh.cpp
+
+  Copyright (c)2021 Kevin Boone, GPL v3.0
+
+  The bounding volume hierarchy that Scene uses to find the solids a
+  ray might hit, and the ray/box test it relies on. The tree is built
+  top-down, splitting each set of solids at the median of their centres
+  along the axis on which the centres are most spread out.
+
+============================================================================*/
+
+#include <algorithm>
+#include <cmath>
+#include "imager.h"
+
+namespace Imager
+{
+    inline double Component(const Vector& v, int axis)
+    {
+        return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+    }
+
+    bool BoundingBox::IntersectsRay(
+        const Vector& vantage,
+        const Vector& direction,
+        double uMax,
+        double& uEnter) const
+    {
+        // Narrow the range of u down to the part in which the ray
+        // lies between each pair of faces.
+        double uLow  = 0.0;
+        double uHigh = uMax;
+        for (int axis=0; axis < 3; ++axis)
+        {
+            const double v = Component(vantage, axis);
+            const double d = Component(direction, axis);
+            const double low  = Component(minCorner, axis);
+            const double high = Component(maxCorner, axis);
+            if (d == 0.0)
+            {
+                // The ray runs parallel to these faces.
+                if (v < low || v > high)
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                double u0 = (low  - v) / d;
+                double u1 = (high - v) / d;
+                if (u0 > u1)
+                {
+                    std::swap(u0, u1);
+                }
+                if (u0 > uLow)
+                {
+                    uLow = u0;
+                }
+                if (u1 < uHigh)
+                {
+                    uHigh = u1;
+                }
+                if (uLow > uHigh)
+                {
+                    return false;
+                }
+            }
+        }
+        uEnter = uLow;
+        return true;
+    }
+
+    void BoundingVolumeHierarchy::Build(
+        const std::vector<SolidObject*>& solidObjectList)
+    {
+        nodes.clear();
+        solidList.clear();
+        unboundedList.clear();
+
+        std::vector<BuildItem>& items = buildItems;
+        items.clear();
+        for (size_t i=0; i < solidObjectList.size(); ++i)
+        {
+            BuildItem item;
+            item.solid = solidObjectList[i];
+            if (!item.solid->IsVisible())
+            {
+                continue;
+            }
+            if (item.solid->GetBoundingBox(item.box))
+            {
+                // Widen the box a little, so that rounding cannot make
+                // a ray that grazes the solid miss its box.
+                const Vector margin(EPSILON, EPSILON, EPSILON);
+                item.box.minCorner = item.box.minCorner - margin;
+                item.box.maxCorner = item.box.maxCorner + margin;
+                item.center = 0.5 * (item.box.minCorner + item.box.maxCorner);
+                items.push_back(item);
+            }
+            else
+            {
+                unboundedList.push_back(item.solid);
+            }
+        }
+
+        if (!items.empty())
+        {
+            // A tree of n leaves has 2n-1 nodes.
+            nodes.reserve(2 * (items.size() / BVH_LEAF_SIZE + 1));
+            solidList.reserve(items.size());
+            BuildNode(items, 0, items.size());
+        }
+
+        BuildSphereArrays();
+    }
+
+    void BoundingVolumeHierarchy::BuildNode(
+        std::vector<BuildItem>& items,
+        size_t first,
+        size_t count)
+    {
+        const size_t index = nodes.size();
+        nodes.push_back(Node());
+
+        BoundingBox box = items[first].box;
+        BoundingBox centers(items[first].center, items[first].center);
+        for (size_t i=first+1; i < first+count; ++i)
+        {
+            box.Include(items[i].box);
+            centers.Include(BoundingBox(items[i].center, items[i].center));
+        }
+        nodes[index].box = box;
+        nodes[index].axis = 0;
+
+        if (count <= BVH_LEAF_SIZE)
+        {
+            nodes[index].firstSolid = solidList.size();
+            nodes[index].solidCount = count;
+            nodes[index].secondChild = 0;
+            for (size_t i=first; i < first+count; ++i)
+            {
+                solidList.push_back(items[i].solid);
+            }
+            return;
+        }
+
+        // Split at the median along the axis on which the centres
+        // are most spread out.
+        const Vector spread = centers.maxCorner - centers.minCorner;
+        int axis = 0;
+        if (spread.y > spread.x)
+        {
+            axis = 1;
+        }
+        if (spread.z > Component(spread, axis))
+        {
+            axis = 2;
+        }
+
+        const size_t half = count / 2;
+        std::nth_element(
+            items.begin() + first,
+            items.begin() + first + half,
+            items.begin() + first + count,
+            [axis](const BuildItem& a, const BuildItem& b)
+            {
+                return Component(a.center, axis) < Component(b.center, axis);
+            });
+
+        nodes[index].axis = axis;
+        nodes[index].firstSolid = 0;
+        nodes[index].solidCount = 0;
+        BuildNode(items, first, half);
+        nodes[index].secondChild = nodes.size();
+        BuildNode(items, first + half, count - half);
+    }
+
+    int BoundingVolumeHierarchy::FindClosestIntersection(
+        const Vector& vantage,
+        const Vector& direction,
+        Intersection& intersection) const
+    {
+        ScratchIntersectionList scratch;
+        IntersectionList& list = scratch.List();
+
+        for (size_t i=0; i < unboundedList.size(); ++i)
+        {
+            RAYTRACE_COUNT(solidTests, 1);
+            unboundedList[i]->AppendClosestIntersections(vantage, direction, list);
+        }
+
+        // The squared distance of the closest intersection so far.
+        // A box that the ray enters further away than this, by more
+        // than the tolerance PickClosestIntersection allows for ties,
+        // cannot hold anything that would change the answer.
+        double closest = 1.0e+300;
+        for (size_t i=0; i < list.size(); ++i)
+        {
+            closest = std::min(closest, list[i].distanceSquared);
+        }
+
+        if (!nodes.empty())
+        {
+            const double directionSquared = direction.MagnitudeSquared();
+            size_t stack[BVH_MAX_DEPTH];
+            int depth = 0;
+            stack[depth++] = 0;
+            while (depth > 0)
+            {
+                const Node& node = nodes[stack[--depth]];
+                double uEnter;
+                if (!node.box.IntersectsRay(vantage, direction, 1.0e+300, uEnter) ||
+                    uEnter * uEnter * directionSquared > closest + EPSILON)
+                {
+                    continue;
+                }
+
+                if (node.solidCount > 0)
+                {
+                    for (size_t i=0; i < node.solidCount; ++i)
+                    {
+                        const size_t before = list.size();
+                        RAYTRACE_COUNT(solidTests, 1);
+                        solidList[node.firstSolid + i]->AppendClosestIntersections(
+                            vantage, direction, list);
+                        for (size_t k=before; k < list.size(); ++k)
+                        {
+                            closest = std::min(closest, list[k].distanceSquared);
+                        }
+                    }
+                }
+                else
+                {
+                    // Visit the child on the side the ray comes from
+                    // first, so that its intersections can rule out
+                    // the other child's.
+                    const size_t firstChild = (&node - &nodes[0]) + 1;
+                    if (Component(direction, node.axis) >= 0.0)
+                    {
+                        stack[depth++] = node.secondChild;
+                        stack[depth++] = firstChild;
+                    }
+                    else
+                    {
+                        stack[depth++] = firstChild;
+                        stack[depth++] = node.secondChild;
+                    }
+                }
+            }
+        }
+
+        return PickClosestIntersection(list, intersection);
+    }
+
+    const SolidObject* BoundingVolumeHierarchy::FindBlocker(
+        const Vector& vantage,
+        const Vector& direction,
+        const SolidObject* skip) const
+    {
+        for (size_t i=0; i < unboundedList.size(); ++i)
+        {
+            const SolidObject* solid = unboundedList[i];
+            if (solid != skip)
+            {
+                RAYTRACE_COUNT(solidTests, 1);
+                if (solid->HasIntersectionBefore(vantage, direction))
+                {
+                    return solid;
+                }
+            }
+        }
+
+        if (!nodes.empty())
+        {
+            size_t stack[BVH_MAX_DEPTH];
+            int depth = 0;
+            stack[depth++] = 0;
+            while (depth > 0)
+            {
+                const Node& node = nodes[stack[--depth]];
+                double uEnter;
+                if (!node.box.IntersectsRay(vantage, direction, 1.0, uEnter))
+                {
+                    continue;
+                }
+
+                if (node.solidCount > 0)
+                {
+                    for (size_t i=0; i < node.solidCount; ++i)
+                    {
+                        const SolidObject* solid = solidList[node.firstSolid + i];
+                        if (solid != skip)
+                        {
+                            RAYTRACE_COUNT(solidTests, 1);
+                            if (solid->HasIntersectionBefore(vantage, direction))
+                            {
+                                return solid;
+                            }
+                        }
+                    }
+                }
+                else
+                {
+                    stack[depth++] = node.secondChild;
+                    stack[depth++] = (&node - &nodes[0]) + 1;
+                }
+            }
+        }
+
+        return NULL;
+    }
+}
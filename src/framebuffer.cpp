@@ -43,6 +43,7 @@ struct _FrameBuffer
   int stride;
   int slop;
   BOOL linear;
+  BOOL is_virtual;
   }; 
 
 
@@ -57,6 +58,31 @@ FrameBuffer *framebuffer_create (const char *fbdev)
   self->fd = -1;
   self->fb_data = NULL;
   self->fb_data_size = 0;
+  self->is_virtual = FALSE;
+  LOG_OUT 
+  return self;
+  }
+
+
+/*==========================================================================
+  framebuffer_create_virtual
+*==========================================================================*/
+FrameBuffer *framebuffer_create_virtual (int width, int height, int bpp)
+  {
+  LOG_IN
+  FrameBuffer *self = framebuffer_create ("virtual");
+  self->is_virtual = TRUE;
+  self->w = width;
+  self->h = height;
+  self->fb_bytes = bpp / 8;
+  self->line_length = self->w * self->fb_bytes;
+  self->stride = self->line_length;
+  self->slop = 0;
+  self->linear = TRUE;
+  self->fb_data_size = self->w * self->h * self->fb_bytes;
+  self->fb_data = (BYTE *)calloc (self->fb_data_size, 1);
+  log_debug ("Created virtual framebuffer %dx%d, bpp %d", width, height, 
+    bpp);
   LOG_OUT 
   return self;
   }
@@ -69,6 +95,11 @@ BOOL framebuffer_init (FrameBuffer *self, char **error)
   {
   LOG_IN
   BOOL ret = FALSE;
+  if (self->is_virtual)
+    {
+    LOG_OUT
+    return TRUE;
+    }
   log_debug ("Opening framebuffer %s", self->fbdev);
   self->fd = open (self->fbdev, O_RDWR);
   if (self->fd >= 0)
@@ -125,7 +156,10 @@ void framebuffer_deinit (FrameBuffer *self)
     {
     if (self->fb_data) 
       {
-      munmap (self->fb_data, self->fb_data_size);
+      if (self->is_virtual)
+        free (self->fb_data);
+      else
+        munmap (self->fb_data, self->fb_data_size);
       self->fb_data = NULL;
       }
     if (self->fd != -1)
@@ -140,17 +174,35 @@ void framebuffer_deinit (FrameBuffer *self)
 
 /*==========================================================================
   framebuffer_set_pixel
+
+  32 bpp pixels are stored as blue, green, red, and an unused byte;
+  24 bpp as blue, green, red; and 16 bpp as a little-endian RGB565
+  word, with red at the top.
 *==========================================================================*/
 void framebuffer_set_pixel (FrameBuffer *self, int x, int y, 
       BYTE r, BYTE g, BYTE b)
   {
-  if (x > 0 && x < self->w && y > 0 && y < self->h)
+  if (x >= 0 && x < self->w && y >= 0 && y < self->h)
     {
-    int index32 = (y * self->w + x) * self->fb_bytes + y * self->slop;
-    self->fb_data [index32++] = b;
-    self->fb_data [index32++] = g;
-    self->fb_data [index32++] = r;
-    self->fb_data [index32] = 0;
+    BYTE *p = self->fb_data + y * self->stride + x * self->fb_bytes;
+    switch (self->fb_bytes)
+      {
+      case 4:
+        p[3] = 0;
+        // Fall through
+      case 3:
+        p[0] = b;
+        p[1] = g;
+        p[2] = r;
+        break;
+      case 2:
+        {
+        int rgb565 = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+        p[0] = rgb565 & 0xFF;
+        p[1] = rgb565 >> 8;
+        }
+        break;
+      }
     }
   }
 
@@ -191,12 +243,25 @@ int framebuffer_get_height (const FrameBuffer *self)
 void framebuffer_get_pixel (const FrameBuffer *self, 
                       int x, int y, BYTE *r, BYTE *g, BYTE *b)
   {
-  if (x > 0 && x < self->w && y > 0 && y < self->h)
+  if (x >= 0 && x < self->w && y >= 0 && y < self->h && 
+      self->fb_bytes >= 2)
     {
-    int index32 = (y * self->w + x) * self->fb_bytes + (y * self->slop);
-    *b = self->fb_data [index32++];
-    *g = self->fb_data [index32++];
-    *r = self->fb_data [index32];
+    const BYTE *p = self->fb_data + y * self->stride + x * self->fb_bytes;
+    if (self->fb_bytes == 2)
+      {
+      // Spread each field over the full range of a byte
+      int rgb565 = p[0] | (p[1] << 8);
+      int r5 = rgb565 >> 11, g6 = (rgb565 >> 5) & 0x3F, b5 = rgb565 & 0x1F;
+      *r = (r5 << 3) | (r5 >> 2);
+      *g = (g6 << 2) | (g6 >> 4);
+      *b = (b5 << 3) | (b5 >> 2);
+      }
+    else
+      {
+      *b = p[0];
+      *g = p[1];
+      *r = p[2];
+      }
     }
   else
     {
@@ -22,6 +22,12 @@ BEGIN_DECLS
 
 FrameBuffer     *framebuffer_create (const char *fbdev);
 
+/** Create a framebuffer in ordinary memory, with nothing on the screen,
+    of the given size and bits per pixel (16, 24 or 32). It is ready to
+    use at once; framebuffer_init() does nothing to it. */
+FrameBuffer     *framebuffer_create_virtual (int width, int height, 
+                      int bpp);
+
 BOOL             framebuffer_init (FrameBuffer *self, char **error);
 
 void             framebuffer_deinit (FrameBuffer *self);
@@ -0,0 +1,158 @@
+/*============================================================================
+
+  framestats.cpp
+
+  Copyright (c)2021 Kevin Boone, GPL v3.0
+
+============================================================================*/
+
+#include <string.h>
+#include <algorithm>
+#include "framestats.h"
+
+// The upper bounds of the histogram's buckets, in milliseconds,
+//   roughly three to a decade; a last bucket holds anything longer
+static const double bucket_limits[] =
+  { 0.01, 0.03, 0.1, 0.3, 1, 3, 10, 30, 100, 300, 1000 };
+#define BUCKETS ((int)(sizeof (bucket_limits) / sizeof (bucket_limits[0])) + 1)
+
+static const char *stage_names[FRAME_STAGE_COUNT] =
+  {
+  "seed",
+  "step",
+  "is_empty",
+  "scene",
+  "bvh",
+  "trace",
+  "heal",
+  "max_colour",
+  "downsample",
+  "blit"
+  };
+
+/*===========================================================================
+
+  FrameStats constructor
+
+===========================================================================*/
+FrameStats::FrameStats (void)
+  {
+  count = 0;
+  next = 0;
+  total = 0;
+  total_late = 0;
+  }
+
+/*===========================================================================
+
+  FrameStats::add
+
+===========================================================================*/
+void FrameStats::add (const double *ms, double late_ms)
+  {
+  memcpy (times[next], ms, sizeof (times[next]));
+  late[next] = late_ms;
+  total++;
+  if (late_ms > 0) total_late++;
+  next = (next + 1) % FRAME_STATS_WINDOW;
+  if (count < FRAME_STATS_WINDOW) count++;
+  }
+
+/*===========================================================================
+
+  FrameStats::dump
+
+===========================================================================*/
+void FrameStats::dump (FILE *f) const
+  {
+  fprintf (f, "Stage times over the last %d frames, in ms\n", count);
+  fprintf (f, "%-10s %8s %8s %8s %8s |", "stage", "mean", "p50", "p99",
+    "max");
+  for (int b = 0; b < BUCKETS - 1; b++)
+    fprintf (f, " <%-5g", bucket_limits[b]);
+  fprintf (f, " more\n");
+
+  double sorted[FRAME_STATS_WINDOW];
+  for (int s = 0; s < FRAME_STAGE_COUNT; s++)
+    {
+    int buckets[BUCKETS] = { 0 };
+    double sum = 0;
+    for (int i = 0; i < count; i++)
+      {
+      double ms = times[i][s];
+      sorted[i] = ms;
+      sum += ms;
+      int b = 0;
+      while (b < BUCKETS - 1 && ms >= bucket_limits[b]) b++;
+      buckets[b]++;
+      }
+    std::sort (sorted, sorted + count);
+
+    // The smallest time that at least p per cent of the frames did not
+    //   exceed
+    double mean = 0, p50 = 0, p99 = 0, max = 0;
+    if (count > 0)
+      {
+      mean = sum / count;
+      p50 = sorted[(count * 50 + 99) / 100 - 1];
+      p99 = sorted[(count * 99 + 99) / 100 - 1];
+      max = sorted[count - 1];
+      }
+    fprintf (f, "%-10s %8.3f %8.3f %8.3f %8.3f |", stage_names[s], mean,
+      p50, p99, max);
+    for (int b = 0; b < BUCKETS; b++)
+      fprintf (f, " %6d", buckets[b]);
+    fprintf (f, "\n");
+    }
+
+  int late_count = 0;
+  double worst = 0;
+  for (int i = 0; i < count; i++)
+    {
+    if (late[i] > 0) late_count++;
+    if (late[i] > worst) worst = late[i];
+    }
+  fprintf (f, "%d of the last %d frames late, by up to %.1f ms; "
+    "%ld of %ld in all\n", late_count, count, worst, total_late, total);
+  fflush (f);
+  }
+
+/*===========================================================================
+
+  FrameStats::write_heading
+
+===========================================================================*/
+void FrameStats::write_heading (FILE *f)
+  {
+  fprintf (f, "frame");
+  for (int s = 0; s < FRAME_STAGE_COUNT; s++)
+    fprintf (f, " %s", stage_names[s]);
+  fprintf (f, " late\n");
+  fflush (f);
+  }
+
+/*===========================================================================
+
+  FrameStats::write_line
+
+===========================================================================*/
+void FrameStats::write_line (FILE *f, long frame, const double *ms, 
+    double late_ms)
+  {
+  fprintf (f, "%ld", frame);
+  for (int s = 0; s < FRAME_STAGE_COUNT; s++)
+    fprintf (f, " %.3f", ms[s]);
+  fprintf (f, " %.3f\n", late_ms);
+  fflush (f);
+  }
+
+/*===========================================================================
+
+  FrameStats::stage_name
+
+===========================================================================*/
+const char *FrameStats::stage_name (FrameStage stage)
+  {
+  return stage_names[stage];
+  }
+
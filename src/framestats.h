@@ -0,0 +1,80 @@
+/*============================================================================
+
+  framestats.h
+
+  Copyright (c)2021 Kevin Boone, GPL v3.0
+
+  Timings for each stage of making a frame, over the last few hundred
+  frames, from which a histogram of each stage's times can be printed;
+  and how many frames were late.
+
+============================================================================*/
+#pragma once
+
+#include <stdio.h>
+
+// How many of the most recent frames are kept
+#define FRAME_STATS_WINDOW 256
+
+/** The stages of making a frame that are timed. The first three are
+    done by the simulation, and the rest by the renderer. */
+typedef enum
+  {
+  // Filling the grid with a new random pattern (only after the
+  //   pattern dies out or repeats, or the generation limit is reached)
+  FRAME_STAGE_SEED = 0,
+  // Life3D::step() or advance()
+  FRAME_STAGE_STEP,
+  // Life3D::is_empty()
+  FRAME_STAGE_IS_EMPTY,
+  // Bringing the scene up to date with the grid
+  FRAME_STAGE_SCENE,
+  // The stages of Scene::SaveImage (see Scene::RenderTimes)
+  FRAME_STAGE_BVH,
+  FRAME_STAGE_TRACE,
+  FRAME_STAGE_HEAL,
+  FRAME_STAGE_MAX_COLOUR,
+  FRAME_STAGE_DOWNSAMPLE,
+  FRAME_STAGE_BLIT,
+  FRAME_STAGE_COUNT
+  } FrameStage;
+
+class FrameStats
+  {
+  public:
+
+  FrameStats (void);
+
+  /** Add the times, in milliseconds, of every stage of one frame,
+      indexed by FrameStage, and how many milliseconds after its 
+      deadline it was drawn, or 0 if it was on time. If the window is 
+      full, the oldest frame is forgotten. */
+  void add (const double *ms, double late_ms);
+
+  /** Write, for each stage, the mean, median, 99th percentile and
+      greatest time over the frames in the window, and a histogram of
+      the times; then how many frames were late, in the window and 
+      since the first. */
+  void dump (FILE *f) const;
+
+  /** Write a line naming the stages, as a heading for write_line() */
+  static void write_heading (FILE *f);
+
+  /** Write the times of one frame, as passed to add(), on one line */
+  static void write_line (FILE *f, long frame, const double *ms, 
+    double late_ms);
+
+  static const char *stage_name (FrameStage stage);
+
+  protected:
+
+  // The times of each frame, in a ring, the latest at next - 1
+  double times[FRAME_STATS_WINDOW][FRAME_STAGE_COUNT];
+  double late[FRAME_STATS_WINDOW];
+  int count;
+  int next;
+  // Frames ever added, and how many of them were late
+  long total;
+  long total_late;
+  };
+
@@ -0,0 +1,469 @@
+/*============================================================================
+
+  hashlife.cpp
+
+  Copyright (c)2020-1 Kevin Boone, GPL v3.0
+
+  See hashlife.h for an outline of the method.
+
+  The standard HashLife algorithm works on an unbounded grid. To get
+  the same wrap-around behaviour as the other Life3D engines, we rely
+  on the fact that the region round any block of cells of a toroidal
+  grid can be assembled from aligned sub-cubes of the grid, which are
+  already nodes in the tree. To advance 2^j generations, each block
+  of 2^(j+1) cells on a side is surrounded by a margin of 2^j cells,
+  taken from the cells on the far side of the grid where necessary.
+  That makes a node of level j+2, whose result is the advanced block.
+  When 2^(j+1) is at least the grid size, the grid is simply repeated
+  in every direction, which costs only a few nodes, since every copy
+  is the same node.
+
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hashlife.h"
+#include "log.h"
+
+// Number of nodes allocated at a time
+#define BLOCK_NODES 65536
+
+// Initial number of hash table buckets; must be a power of two
+#define INITIAL_TABLE_SIZE 65536
+
+// Index of a child within its parent, from its position (each 0 or 1)
+#define CHILD(x, y, z) (((x) << 2) | ((y) << 1) | (z))
+
+/*===========================================================================
+
+  HashLife3D constructor
+
+===========================================================================*/
+HashLife3D::HashLife3D (size_t max_bytes)
+  {
+  this->max_bytes = max_bytes;
+  birth_mask = (1 << 4) | (1 << 5);
+  survive_mask = (1 << 5) | (1 << 6) | (1 << 7);
+  memset (leaf, 0, sizeof (leaf));
+  leaf[0].hash = 0x2545F4914F6CDD1DULL;
+  leaf[1].hash = 0x9E3779B97F4A7C15ULL;
+  table = NULL;
+  table_size = 0;
+  nodes = 0;
+  block_used = BLOCK_NODES;
+  clear();
+  }
+
+/*===========================================================================
+
+  HashLife3D destructor
+
+===========================================================================*/
+HashLife3D::~HashLife3D (void)
+  {
+  for (size_t i = 0; i < blocks.size(); i++)
+    free (blocks[i]);
+  free (table);
+  }
+
+/*===========================================================================
+
+  HashLife3D::set_rule
+
+===========================================================================*/
+void HashLife3D::set_rule (uint32_t birth, uint32_t survive)
+  {
+  if (birth == birth_mask && survive == survive_mask) return;
+  birth_mask = birth;
+  survive_mask = survive;
+  // Every remembered result was worked out under the old rule
+  clear();
+  }
+
+/*===========================================================================
+
+  HashLife3D::size_ok
+
+===========================================================================*/
+bool HashLife3D::size_ok (int size)
+  {
+  return size > 0 && (size & (size - 1)) == 0;
+  }
+
+/*===========================================================================
+
+  HashLife3D::clear
+
+  Throw away every node, and all the remembered results
+
+===========================================================================*/
+void HashLife3D::clear (void)
+  {
+  if (nodes > 0)
+    log_debug ("HashLife cache cleared at %ld nodes", (long)nodes);
+  for (size_t i = 0; i < blocks.size(); i++)
+    free (blocks[i]);
+  blocks.clear();
+  block_used = BLOCK_NODES;
+  free (table);
+  table_size = INITIAL_TABLE_SIZE;
+  table = (Node **)calloc (table_size, sizeof (Node *));
+  nodes = 0;
+  empties.clear();
+  empties.push_back (&leaf[0]);
+  }
+
+/*===========================================================================
+
+  HashLife3D::rehash
+
+  Double the size of the hash table
+
+===========================================================================*/
+void HashLife3D::rehash (void)
+  {
+  size_t new_size = table_size * 2;
+  Node **new_table = (Node **)calloc (new_size, sizeof (Node *));
+  for (size_t b = 0; b < table_size; b++)
+    {
+    Node *n = table[b];
+    while (n)
+      {
+      Node *next = n->next;
+      size_t nb = n->hash & (new_size - 1);
+      n->next = new_table[nb];
+      new_table[nb] = n;
+      n = next;
+      }
+    }
+  free (table);
+  table = new_table;
+  table_size = new_size;
+  }
+
+/*===========================================================================
+
+  HashLife3D::intern
+
+  Return the one node with the given children, creating it if necessary
+
+===========================================================================*/
+HashLife3D::Node *HashLife3D::intern (int level, Node *const *child)
+  {
+  uint64_t h = (uint64_t)level * 0xD6E8FEB86659FD93ULL;
+  for (int i = 0; i < 8; i++)
+    {
+    h = (h ^ child[i]->hash) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 29;
+    }
+
+  size_t b = h & (table_size - 1);
+  for (Node *n = table[b]; n; n = n->next)
+    {
+    if (n->hash == h && n->level == level
+         && memcmp (n->child, child, sizeof (n->child)) == 0)
+      return n;
+    }
+
+  if (block_used == BLOCK_NODES)
+    {
+    blocks.push_back ((Node *)malloc (BLOCK_NODES * sizeof (Node)));
+    block_used = 0;
+    }
+  Node *n = &blocks.back()[block_used++];
+  memcpy (n->child, child, sizeof (n->child));
+  n->result = NULL;
+  n->hash = h;
+  n->level = level;
+  n->next = table[b];
+  table[b] = n;
+  nodes++;
+  if (nodes > table_size) rehash();
+  return n;
+  }
+
+/*===========================================================================
+
+  HashLife3D::empty
+
+===========================================================================*/
+HashLife3D::Node *HashLife3D::empty (int level)
+  {
+  while ((int)empties.size() <= level)
+    {
+    Node *c[8];
+    for (int i = 0; i < 8; i++) c[i] = empties.back();
+    empties.push_back (intern (empties.size(), c));
+    }
+  return empties[level];
+  }
+
+/*===========================================================================
+
+  HashLife3D::result_base
+
+  The result of a level 2 node -- the 2x2x2 cells at the centre of a
+  4x4x4 cube, one generation on -- worked out cell by cell.
+
+===========================================================================*/
+HashLife3D::Node *HashLife3D::result_base (Node *node)
+  {
+  int cell[4][4][4];
+  for (int x = 0; x < 4; x++)
+    for (int y = 0; y < 4; y++)
+      for (int z = 0; z < 4; z++)
+        {
+        Node *c = node->child[CHILD (x >> 1, y >> 1, z >> 1)];
+        cell[x][y][z] = c->child[CHILD (x & 1, y & 1, z & 1)] == &leaf[1];
+        }
+
+  Node *out[8];
+  for (int x = 1; x <= 2; x++)
+    for (int y = 1; y <= 2; y++)
+      for (int z = 1; z <= 2; z++)
+        {
+        int n = -cell[x][y][z];
+        for (int dx = -1; dx <= 1; dx++)
+          for (int dy = -1; dy <= 1; dy++)
+            for (int dz = -1; dz <= 1; dz++)
+              n += cell[x + dx][y + dy][z + dz];
+        uint32_t mask = cell[x][y][z] ? survive_mask : birth_mask;
+        out[CHILD (x - 1, y - 1, z - 1)] = &leaf[(mask >> n) & 1];
+        }
+  return intern (1, out);
+  }
+
+/*===========================================================================
+
+  HashLife3D::result
+
+  The level k-1 cube at the centre of a level k node, 2^(k-2)
+  generations on. The 4x4x4 grandchildren are formed into 27
+  overlapping level k-1 cubes, and each is advanced by 2^(k-3)
+  generations. The 3x3x3 results are formed into 8 overlapping cubes,
+  which are advanced by another 2^(k-3) generations, and those results
+  are the eight children of the answer.
+
+===========================================================================*/
+HashLife3D::Node *HashLife3D::result (Node *node)
+  {
+  if (node->result) return node->result;
+
+  int k = node->level;
+  if (node == empty (k))
+    node->result = empty (k - 1);
+  else if (k == 2)
+    node->result = result_base (node);
+  else
+    {
+    Node *g[4][4][4];
+    for (int x = 0; x < 4; x++)
+      for (int y = 0; y < 4; y++)
+        for (int z = 0; z < 4; z++)
+          g[x][y][z] = node->child[CHILD (x >> 1, y >> 1, z >> 1)]
+                        ->child[CHILD (x & 1, y & 1, z & 1)];
+
+    Node *c[8];
+    Node *r[3][3][3];
+    for (int x = 0; x < 3; x++)
+      for (int y = 0; y < 3; y++)
+        for (int z = 0; z < 3; z++)
+          {
+          for (int i = 0; i < 8; i++)
+            c[i] = g[x + (i >> 2)][y + ((i >> 1) & 1)][z + (i & 1)];
+          r[x][y][z] = result (intern (k - 1, c));
+          }
+
+    Node *q[8];
+    for (int x = 0; x < 2; x++)
+      for (int y = 0; y < 2; y++)
+        for (int z = 0; z < 2; z++)
+          {
+          for (int i = 0; i < 8; i++)
+            c[i] = r[x + (i >> 2)][y + ((i >> 1) & 1)][z + (i & 1)];
+          q[CHILD (x, y, z)] = result (intern (k - 1, c));
+          }
+    node->result = intern (k - 1, q);
+    }
+  return node->result;
+  }
+
+/*===========================================================================
+
+  HashLife3D::build
+
+  Make the level node for the cube of the grid whose lowest corner
+  is at x, y, z
+
+===========================================================================*/
+HashLife3D::Node *HashLife3D::build (const unsigned char *alive, int size,
+    int level, int x, int y, int z)
+  {
+  if (level == 0)
+    return &leaf[alive[(x * size + y) * size + z] != 0];
+
+  int half = 1 << (level - 1);
+  Node *c[8];
+  for (int i = 0; i < 8; i++)
+    c[i] = build (alive, size, level - 1, x + (i >> 2) * half,
+             y + ((i >> 1) & 1) * half, z + (i & 1) * half);
+  return intern (level, c);
+  }
+
+/*===========================================================================
+
+  HashLife3D::extract
+
+  Write the live cells of a node into the grid, with its lowest corner
+  at ox, oy, oz, wrapping round at the edges. Only live cells are
+  written, so the grid must be cleared first.
+
+===========================================================================*/
+void HashLife3D::extract (Node *node, int level, int ox, int oy, int oz,
+    unsigned char *alive, int size, int mask) const
+  {
+  if (level == 0)
+    {
+    if (node == &leaf[1])
+      alive[((ox & mask) * size + (oy & mask)) * size + (oz & mask)] = 1;
+    return;
+    }
+  if ((int)empties.size() > level && node == empties[level]) return;
+
+  int half = 1 << (level - 1);
+  for (int i = 0; i < 8; i++)
+    extract (node->child[i], level - 1, ox + (i >> 2) * half,
+      oy + ((i >> 1) & 1) * half, oz + (i & 1) * half, alive, size, mask);
+  }
+
+/*===========================================================================
+
+  HashLife3D::find_aligned
+
+  Find the level node within root whose lowest corner is at x, y, z.
+  The corner must be a multiple of 2^level.
+
+===========================================================================*/
+HashLife3D::Node *HashLife3D::find_aligned (Node *root, int root_level,
+    int level, int x, int y, int z) const
+  {
+  Node *n = root;
+  for (int l = root_level; l > level; l--)
+    {
+    int half = 1 << (l - 1);
+    int i = CHILD (x >= half, y >= half, z >= half);
+    x &= half - 1;
+    y &= half - 1;
+    z &= half - 1;
+    n = n->child[i];
+    }
+  return n;
+  }
+
+/*===========================================================================
+
+  HashLife3D::leap
+
+  Advance the grid by 2^j generations
+
+===========================================================================*/
+void HashLife3D::leap (unsigned char *alive, int size, int j)
+  {
+  int m = 0;
+  while ((1 << m) < size) m++;
+
+  Node *root = build (alive, size, m, 0, 0, 0);
+  std::vector<unsigned char> out (size * size * size, 0);
+
+  if (j >= m - 1)
+    {
+    // Repeat the grid until it is at least 2^(j+2) across. The
+    //   result is then at least twice the size of the grid, and
+    //   starts 2^j cells in from the lowest corner.
+    Node *t = root;
+    for (int l = m; l < j + 2; l++)
+      {
+      Node *c[8];
+      for (int i = 0; i < 8; i++) c[i] = t;
+      t = intern (l + 1, c);
+      }
+    Node *r = result (t);
+    for (int l = j + 1; l > m; l--)
+      r = r->child[0];
+    int shift = j >= m ? 0 : size / 2;
+    extract (r, m, shift, shift, shift, &out[0], size, size - 1);
+    }
+  else
+    {
+    // The grid is a cnt x cnt x cnt array of level j nodes. Each
+    //   output block is 2x2x2 of these, and the node that it is the
+    //   result of is 4x4x4, starting one back in each direction.
+    int cnt = size >> j;
+    std::vector<Node *> a (cnt * cnt * cnt);
+    bool stale = true;
+
+    for (int bx = 0; bx < cnt / 2; bx++)
+      for (int by = 0; by < cnt / 2; by++)
+        for (int bz = 0; bz < cnt / 2; bz++)
+          {
+          // A big leap can fill the cache part-way through. The grid
+          //   is not written until the end, so the cache can be thrown
+          //   away between blocks, and the aligned nodes made again.
+          if (!stale && nodes * sizeof (Node) > max_bytes)
+            {
+            clear();
+            root = build (alive, size, m, 0, 0, 0);
+            stale = true;
+            }
+          if (stale)
+            {
+            for (int x = 0; x < cnt; x++)
+              for (int y = 0; y < cnt; y++)
+                for (int z = 0; z < cnt; z++)
+                  a[(x * cnt + y) * cnt + z] =
+                    find_aligned (root, m, j, x << j, y << j, z << j);
+            stale = false;
+            }
+
+          Node *h[8];
+          for (int k = 0; k < 8; k++)
+            {
+            Node *c[8];
+            for (int i = 0; i < 8; i++)
+              {
+              int x = (2 * bx - 1 + 2 * (k >> 2) + (i >> 2) + cnt) % cnt;
+              int y = (2 * by - 1 + 2 * ((k >> 1) & 1) + ((i >> 1) & 1)
+                        + cnt) % cnt;
+              int z = (2 * bz - 1 + 2 * (k & 1) + (i & 1) + cnt) % cnt;
+              c[i] = a[(x * cnt + y) * cnt + z];
+              }
+            h[k] = intern (j + 1, c);
+            }
+          Node *r = result (intern (j + 2, h));
+          extract (r, j + 1, bx << (j + 1), by << (j + 1), bz << (j + 1),
+            &out[0], size, size - 1);
+          }
+    }
+
+  memcpy (alive, &out[0], out.size());
+  }
+
+/*===========================================================================
+
+  HashLife3D::advance
+
+===========================================================================*/
+void HashLife3D::advance (unsigned char *alive, int size, long gens)
+  {
+  // Any number of generations can be made up of leaps of powers of two;
+  //   since the rules are the same throughout, the order does not matter
+  for (int j = 0; gens > 0; j++, gens >>= 1)
+    {
+    if ((gens & 1) == 0) continue;
+    if (nodes * sizeof (Node) > max_bytes) clear();
+    leap (alive, size, j);
+    }
+  log_debug ("HashLife cache holds %ld nodes", (long)nodes);
+  }
+
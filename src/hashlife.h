@@ -0,0 +1,94 @@
+/*============================================================================
+
+  hashlife.h
+
+  Copyright (c)2020-1 Kevin Boone, GPL v3.0
+
+  A three-dimensional version of Bill Gosper's HashLife algorithm.
+
+  The grid is held as an octree, in which each node of level k is a
+  cube of 2^k cells on each side, made of eight nodes of level k-1.
+  Level 0 nodes are single cells. Nodes are canonical: there is only
+  ever one node with a given set of children, so identical regions of
+  space, wherever and whenever they occur, share a node. Each node of
+  level k >= 2 remembers its "result": the level k-1 cube at its centre,
+  2^(k-2) generations later. Since the result depends only on the node,
+  it need only be worked out once, and repetitive patterns can be
+  advanced by very large numbers of generations at little cost.
+
+  The grid wraps round at the edges, and must be a cube whose side
+  is a power of two. Only liveness is modelled, not age.
+
+============================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class HashLife3D
+  {
+  public:
+
+  /** max_bytes is the memory that the node cache may use before it
+      is thrown away and started afresh. The limit is soft: it is
+      checked before each leap, and between the blocks of a leap, so
+      the cache can overshoot it by the nodes that one block needs.
+      When a leap spans the whole grid, that is the whole leap. */
+  HashLife3D (size_t max_bytes);
+  ~HashLife3D (void);
+
+  /** Advance a grid of size x size x size cells by gens generations.
+      alive holds one byte per cell, non-zero if the cell is alive,
+      indexed as x * size * size + y * size + z. It is overwritten with
+      the new generation. size must be a power of two. */
+  void advance (unsigned char *alive, int size, long gens);
+
+  /** Set the rule, as birth and survival masks in the form used by
+      Life3DRule. Changing the rule throws away the cache. The default
+      is B45/S567. */
+  void set_rule (uint32_t birth, uint32_t survive);
+
+  /** Returns true if size is one that advance() can handle */
+  static bool size_ok (int size);
+
+  /** Returns the number of nodes in the cache */
+  size_t get_nodes (void) const { return nodes; }
+
+  protected:
+
+  struct Node
+    {
+    Node *child[8];  // Indexed by (x << 2) | (y << 1) | z, each 0 or 1
+    Node *result;    // NULL until worked out
+    Node *next;      // Next in the same hash table bucket
+    uint64_t hash;
+    int level;
+    };
+
+  Node *intern (int level, Node *const *child);
+  Node *result (Node *node);
+  Node *result_base (Node *node);
+  Node *build (const unsigned char *alive, int size, int level,
+                 int x, int y, int z);
+  void extract (Node *node, int level, int ox, int oy, int oz,
+                 unsigned char *alive, int size, int mask) const;
+  Node *find_aligned (Node *root, int root_level, int level,
+                 int x, int y, int z) const;
+  void leap (unsigned char *alive, int size, int j);
+  Node *empty (int level);
+  void clear (void);
+  void rehash (void);
+
+  size_t max_bytes;
+  uint32_t birth_mask;
+  uint32_t survive_mask;
+  Node leaf[2];             // The dead cell and the live cell
+  Node **table;             // Hash table of all nodes above level 0
+  size_t table_size;        // Always a power of two
+  size_t nodes;
+  std::vector<Node *> blocks; // Nodes are allocated in large blocks
+  size_t block_used;
+  std::vector<Node *> empties; // The empty node at each level
+  };
+
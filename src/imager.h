@@ -29,6 +29,7 @@
 #ifndef __DDC_IMAGER_H
 #define __DDC_IMAGER_H
 
+#include <algorithm>
 #include <vector>
 #include <cmath>
 #include "algebra.h"
@@ -36,6 +37,15 @@
 
 #define RAYTRACE_DEBUG_POINTS 0
 
+// KB -- Set to 1 (for example with EXTRA_CFLAGS=-DRAYTRACE_COUNTERS=1)
+// to count the rays traced and the intersection tests done for each 
+// image; see RayCounters.  When 0, the counting is compiled out.
+#ifndef RAYTRACE_COUNTERS
+#define RAYTRACE_COUNTERS 0
+#endif
+
+class ThreadPool;   // KB
+
 namespace Imager
 {
     const double PI = 3.141592653589793238462643383279502884;
@@ -57,6 +67,7 @@ namespace Imager
     // Forward declarations
     class SolidObject;
     class ImageBuffer;
+    class IncrementalImage;     // KB
 
     //------------------------------------------------------------------------
 
@@ -77,17 +88,6 @@ namespace Imager
 
     //------------------------------------------------------------------------
 
-    // An exception thrown when multiple intersections lie at the
-    // same distance from the vantage point.  SaveImage catches
-    // these and marks such pixels as ambiguous.  It performs a second
-    // pass later that averages the color values of surrounding 
-    // non-ambiguous pixels.
-    class AmbiguousIntersectionException
-    {
-    };
-
-    //------------------------------------------------------------------------
-
     class Vector
     {
     public:
@@ -339,6 +339,17 @@ namespace Imager
         const Color& GetGlossColor() const { return glossColor; }
         const double GetOpacity()    const { return opacity;    }
 
+        // KB -- True if no light passes through the surface, and none
+        // is mirrored by it: all it does is scatter.
+        bool IsOpaqueMatte() const
+        {
+            return 
+                (opacity == 1.0) &&
+                (glossColor.red   == 0.0) && 
+                (glossColor.green == 0.0) && 
+                (glossColor.blue  == 0.0);
+        }
+
     protected:
         void ValidateReflectionColor(const Color& color) const;
 
@@ -397,10 +408,150 @@ namespace Imager
 
     typedef std::vector<Intersection> IntersectionList;
 
+    // Borrows an empty IntersectionList from a pool belonging to the
+    // calling thread, and gives it back when it goes out of scope.
+    // Solids and scenes use these in place of member variables for 
+    // their temporary lists, so that any number of threads can trace 
+    // rays through the same scene at once.  Borrowing nests: a solid 
+    // may borrow a list while its caller still holds one.  The lists 
+    // are never freed while the thread lives, so once rendering has 
+    // warmed up, borrowing one involves no memory allocation.
+    class ScratchIntersectionList
+    {
+    public:
+        ScratchIntersectionList();
+        ~ScratchIntersectionList();
+
+        IntersectionList& List() { return list; }
+
+    private:
+        // Not copyable: each borrow must be returned exactly once.
+        ScratchIntersectionList(const ScratchIntersectionList&);
+        ScratchIntersectionList& operator= (const ScratchIntersectionList&);
+
+        IntersectionList& list;
+    };
+
     int PickClosestIntersection(
         const IntersectionList& list, 
         Intersection& intersection);
 
+    //------------------------------------------------------------------------
+    // KB -- Counts of the work done by the ray tracer.  Each thread 
+    // counts into its own threadRayCounters, so the counting costs no
+    // more than an increment; Scene::SaveImage adds up what each thread
+    // did for the image.  Dividing the tests by the rays shows how well
+    // the bounding volume hierarchy, or a SphereLattice, is doing its job.
+
+    struct RayCounters
+    {
+        unsigned long primaryRays;      // from the camera
+        unsigned long shadowRays;       // from a surface to a light source
+        unsigned long reflectionRays;
+        unsigned long refractionRays;
+        unsigned long solidTests;       // a ray tried against one solid
+        unsigned long sphereTests;      // a ray tried against one sphere
+        unsigned long sphereHits;       // ... that found an intersection
+        unsigned long ambiguities;      // rays given up on because of a tie
+
+        RayCounters()
+            : primaryRays(0)
+            , shadowRays(0)
+            , reflectionRays(0)
+            , refractionRays(0)
+            , solidTests(0)
+            , sphereTests(0)
+            , sphereHits(0)
+            , ambiguities(0)
+        {
+        }
+
+        RayCounters& operator+= (const RayCounters& other)
+        {
+            primaryRays += other.primaryRays;
+            shadowRays += other.shadowRays;
+            reflectionRays += other.reflectionRays;
+            refractionRays += other.refractionRays;
+            solidTests += other.solidTests;
+            sphereTests += other.sphereTests;
+            sphereHits += other.sphereHits;
+            ambiguities += other.ambiguities;
+            return *this;
+        }
+
+        RayCounters& operator-= (const RayCounters& other)
+        {
+            primaryRays -= other.primaryRays;
+            shadowRays -= other.shadowRays;
+            reflectionRays -= other.reflectionRays;
+            refractionRays -= other.refractionRays;
+            solidTests -= other.solidTests;
+            sphereTests -= other.sphereTests;
+            sphereHits -= other.sphereHits;
+            ambiguities -= other.ambiguities;
+            return *this;
+        }
+    };
+
+#if RAYTRACE_COUNTERS
+    extern thread_local RayCounters threadRayCounters;
+    #define RAYTRACE_COUNT(counter, n) (Imager::threadRayCounters.counter += (n))
+#else
+    #define RAYTRACE_COUNT(counter, n)
+#endif
+
+    //------------------------------------------------------------------------
+    // KB -- An axis-aligned box, used to enclose a solid.
+
+    struct BoundingBox
+    {
+        Vector minCorner;
+        Vector maxCorner;
+
+        BoundingBox()
+        {
+        }
+
+        BoundingBox(const Vector& _minCorner, const Vector& _maxCorner)
+            : minCorner(_minCorner)
+            , maxCorner(_maxCorner)
+        {
+        }
+
+        // Grows this box to enclose 'other' as well.
+        void Include(const BoundingBox& other)
+        {
+            minCorner.x = std::min(minCorner.x, other.minCorner.x);
+            minCorner.y = std::min(minCorner.y, other.minCorner.y);
+            minCorner.z = std::min(minCorner.z, other.minCorner.z);
+            maxCorner.x = std::max(maxCorner.x, other.maxCorner.x);
+            maxCorner.y = std::max(maxCorner.y, other.maxCorner.y);
+            maxCorner.z = std::max(maxCorner.z, other.maxCorner.z);
+        }
+
+        // Shrinks this box to the part of it that is inside 'other'.
+        // If they do not overlap, the box becomes empty, and no ray
+        // intersects it.
+        void Restrict(const BoundingBox& other)
+        {
+            minCorner.x = std::max(minCorner.x, other.minCorner.x);
+            minCorner.y = std::max(minCorner.y, other.minCorner.y);
+            minCorner.z = std::max(minCorner.z, other.minCorner.z);
+            maxCorner.x = std::min(maxCorner.x, other.maxCorner.x);
+            maxCorner.y = std::min(maxCorner.y, other.maxCorner.y);
+            maxCorner.z = std::min(maxCorner.z, other.maxCorner.z);
+        }
+
+        // If the ray from 'vantage' in 'direction' passes through this
+        // box at some point vantage + u*direction with 0 <= u <= uMax,
+        // returns true and sets uEnter to the smallest such u.
+        bool IntersectsRay(
+            const Vector& vantage,
+            const Vector& direction,
+            double uMax,
+            double& uEnter) const;
+    };
+
     //------------------------------------------------------------------------
 
     class Taggable       // helps debugging; allows caller to assign names to things
@@ -434,6 +585,7 @@ namespace Imager
             : center(_center)
             , refractiveIndex(REFRACTION_GLASS)
             , isFullyEnclosed(_isFullyEnclosed)
+            , isVisible(true)
         {
         }
 
@@ -449,6 +601,43 @@ namespace Imager
             const Vector& direction, 
             IntersectionList& intersectionList) const = 0;
 
+        // KB -- Appends to 'intersectionList' at least those intersections
+        // that lie closest to the vantage point (including any tied for
+        // closest); the others may be left out.  This is all that 
+        // FindClosestIntersection needs, so a solid that can find the
+        // closest intersections without finding the rest can override
+        // this to save time.  By default, it appends all of them.
+        virtual void AppendClosestIntersections(
+            const Vector& vantage, 
+            const Vector& direction, 
+            IntersectionList& intersectionList) const
+        {
+            AppendAllIntersections(vantage, direction, intersectionList);
+        }
+
+        // KB -- Returns true if this solid has any intersection at 
+        // vantage + u*direction with u less than 1; that is, if it
+        // blocks the line from the vantage point to vantage + direction.
+        // This is all a shadow ray needs to know, so a solid that can 
+        // answer it without building a list of intersections can
+        // override it to save time.
+        virtual bool HasIntersectionBefore(
+            const Vector& vantage, 
+            const Vector& direction) const
+        {
+            ScratchIntersectionList scratch;
+            AppendClosestIntersections(vantage, direction, scratch.List());
+            const double gapDistanceSquared = direction.MagnitudeSquared();
+            for (size_t i=0; i < scratch.List().size(); ++i)
+            {
+                if (scratch.List()[i].distanceSquared < gapDistanceSquared)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
         // Searches for any intersections with this solid from the 
         // vantage point in the given direction.  If none are found, the 
         // function returns 0 and the 'intersection' parameter is left 
@@ -466,9 +655,9 @@ namespace Imager
             const Vector& direction, 
             Intersection &intersection) const
         {
-            cachedIntersectionList.clear();
-            AppendAllIntersections(vantage, direction, cachedIntersectionList);
-            return PickClosestIntersection(cachedIntersectionList, intersection);
+            ScratchIntersectionList scratch;
+            AppendClosestIntersections(vantage, direction, scratch.List());
+            return PickClosestIntersection(scratch.List(), intersection);
         }
 
         // Returns true if the given point is inside this solid object.
@@ -478,6 +667,16 @@ namespace Imager
         // to override this default algorithm.
         virtual bool Contains(const Vector& point) const;
 
+        // KB -- Sets 'box' to an axis-aligned box that encloses all 
+        // of this solid's surfaces, and returns true; or returns false
+        // if the solid is unbounded, or its extent is unknown.  Scene
+        // uses the boxes to avoid testing rays against solids they 
+        // cannot hit.  Solids without a box are tested against every ray.
+        virtual bool GetBoundingBox(BoundingBox& box) const
+        {
+            return false;
+        }
+
         // Returns the optical properties (reflection and refraction)
         // at a given point on the surface of this solid.
         // By default, the optical properties are the same everywhere,
@@ -492,6 +691,15 @@ namespace Imager
             return uniformOptics;
         }
 
+        // KB -- Returns true if every point on the surface is fully
+        // opaque and has no gloss, so that Scene can shade it without
+        // tracing any reflected or refracted rays.  A derived class 
+        // that overrides SurfaceOptics must override this to match.
+        virtual bool IsOpaqueMatte() const
+        {
+            return uniformOptics.IsOpaqueMatte();
+        }
+
         // Returns the index of refraction of this solid.  
         // The refractive index is uniform throughout the solid.
         double GetRefractiveIndex() const
@@ -515,6 +723,7 @@ namespace Imager
             center.x += dx;
             center.y += dy;
             center.z += dz;
+            LayoutChanged();    // KB
             return *this;
         }
 
@@ -587,7 +796,35 @@ namespace Imager
             refractiveIndex = refraction;
         }
 
+        // KB -- A solid in a scene that is not visible is left out of
+        // the image altogether, as if it had been removed, but can be
+        // brought back without being made again.  Solids are visible
+        // unless this is called.  Like the optics, this must not change
+        // while an image is being rendered.
+        void SetVisible(bool visible)
+        {
+            if (visible != isVisible)
+            {
+                isVisible = visible;
+                LayoutChanged();
+            }
+        }
+
+        bool IsVisible() const
+        {
+            return isVisible;
+        }
+
+        // KB -- A number that changes whenever any solid, in any scene,
+        // is shown, hidden, or translated, so that a scene can tell 
+        // whether the solids have moved since its last image.  Rotations
+        // are not counted, since each kind of solid does its own; see
+        // Scene::SolidsMoved.
+        static unsigned long GetLayoutSerial();
+
     protected:
+        static void LayoutChanged();
+
         const Optics& GetUniformOptics() const
         {
             return uniformOptics;
@@ -615,12 +852,7 @@ namespace Imager
         // and therefore make this flag irrelevant.
         const bool isFullyEnclosed;
 
-        // The following members are an optimization to minimize 
-        // the overhead and fragmentation caused by repeated 
-        // memory allocations creating and destroying 
-        // std::vector contents.
-        mutable IntersectionList cachedIntersectionList;
-        mutable IntersectionList enclosureList;
+        bool isVisible;     // KB
     };
 
     //------------------------------------------------------------------------
@@ -667,6 +899,12 @@ namespace Imager
 
         virtual SolidObject& Translate(double dx, double dy, double dz);
 
+        // KB -- The surfaces are all those of the nested solids.
+        virtual bool IsOpaqueMatte() const
+        {
+            return left->IsOpaqueMatte() && right->IsOpaqueMatte();
+        }
+
     protected:
         SolidObject& Left()  const { return *left;  }
         SolidObject& Right() const { return *right; }
@@ -689,11 +927,6 @@ namespace Imager
             double a, 
             double b);
 
-        // The following list is for caching and filtering 
-        // intersections with the left and right nested solids.
-        // It is mutable to allow modification from const methods.
-        mutable IntersectionList tempIntersectionList;
-
     private:
         SolidObject* left;
         SolidObject* right;
@@ -721,6 +954,18 @@ namespace Imager
             // it is in either of the nested solids.
             return Left().Contains(point) || Right().Contains(point);
         }
+
+        virtual bool GetBoundingBox(BoundingBox& box) const
+        {
+            // The union is bounded only if both nested solids are.
+            BoundingBox rightBox;
+            if (Left().GetBoundingBox(box) && Right().GetBoundingBox(rightBox))
+            {
+                box.Include(rightBox);
+                return true;
+            }
+            return false;
+        }
     };
 
     //------------------------------------------------------------------------
@@ -749,6 +994,23 @@ namespace Imager
             return Left().Contains(point) && Right().Contains(point);
         }
 
+        virtual bool GetBoundingBox(BoundingBox& box) const
+        {
+            // The intersection lies within both nested solids, so
+            // within whichever of their boxes are known.  This also
+            // bounds a SetDifference by its left solid.
+            BoundingBox rightBox;
+            if (Left().GetBoundingBox(box))
+            {
+                if (Right().GetBoundingBox(rightBox))
+                {
+                    box.Restrict(rightBox);
+                }
+                return true;
+            }
+            return Right().GetBoundingBox(box);
+        }
+
     private:
         void AppendOverlappingIntersections(
             const Vector& vantage,
@@ -791,6 +1053,17 @@ namespace Imager
             return !other->Contains(point);
         }
 
+        virtual bool GetBoundingBox(BoundingBox& box) const
+        {
+            // Everything outside a bounded solid is unbounded.
+            return false;
+        }
+
+        virtual bool IsOpaqueMatte() const
+        {
+            return other->IsOpaqueMatte();
+        }
+
         virtual void AppendAllIntersections(
             const Vector& vantage, 
             const Vector& direction, 
@@ -862,6 +1135,10 @@ namespace Imager
             const Vector& direction, 
             IntersectionList& intersectionList) const;
 
+        virtual bool HasIntersectionBefore(
+            const Vector& vantage, 
+            const Vector& direction) const;
+
         virtual bool Contains(const Vector& point) const
         {
             // Add a little bit to the actual radius to be more tolerant
@@ -874,6 +1151,19 @@ namespace Imager
             return (point - Center()).MagnitudeSquared() <= (r * r);
         }
 
+        virtual bool GetBoundingBox(BoundingBox& box) const
+        {
+            const Vector extent(radius, radius, radius);
+            box = BoundingBox(Center() - extent, Center() + extent);
+            return true;
+        }
+
+        // KB
+        double GetRadius() const
+        {
+            return radius;
+        }
+
         // The nice thing about a sphere is that rotating 
         // it has no effect on its appearance!
         virtual SolidObject& RotateX(double angleInDegrees) { return *this; }
@@ -905,6 +1195,150 @@ namespace Imager
 
     //------------------------------------------------------------------------
 
+    // KB -- The most solids a leaf of a BoundingVolumeHierarchy may hold.
+    const size_t BVH_LEAF_SIZE = 4;
+
+    // KB -- The deepest a BoundingVolumeHierarchy can be, since each 
+    // split halves the solids.  A search of the tree needs a stack 
+    // this deep.
+    const int BVH_MAX_DEPTH = 64;
+
+    // KB -- A bounding volume hierarchy: a binary tree of boxes over a 
+    // set of solids, in which each box encloses all the solids below it.
+    // A ray that misses a box cannot hit anything inside it, so the ray
+    // need only be tested against the solids in the boxes it does pass
+    // through.  Solids that have no bounding box are kept aside, and 
+    // tested against every ray.
+    class BoundingVolumeHierarchy
+    {
+    public:
+        // The most rays FindClosestSpheres can trace at once.
+        static const int MAX_PACKET_WIDTH = 8;
+
+        BoundingVolumeHierarchy()
+            : packetWidth(0)
+        {
+        }
+
+        // Builds the tree over those of the given solids that are 
+        // visible, replacing any previous tree.  The solids must not 
+        // move, or be deleted, while the tree is in use.
+        void Build(const std::vector<SolidObject*>& solidObjectList);
+
+        // As SolidObject::FindClosestIntersection, over all the solids.
+        int FindClosestIntersection(
+            const Vector& vantage, 
+            const Vector& direction, 
+            Intersection& intersection) const;
+
+        // Returns a solid that has an intersection at 
+        // vantage + u*direction with u less than 1, or NULL if there
+        // is none.  The solid 'skip', if not NULL, is not tested; the
+        // caller has already found that it does not block the line.
+        const SolidObject* FindBlocker(
+            const Vector& vantage, 
+            const Vector& direction,
+            const SolidObject* skip) const;
+
+        size_t GetNodeCount() const
+        {
+            return nodes.size();
+        }
+
+        // Returns true if the tree holds no solids at all.
+        bool IsEmpty() const
+        {
+            return nodes.empty() && unboundedList.empty();
+        }
+
+        // Sets 'box' to enclose all the solids, and returns true; or
+        // returns false if any solid is unbounded, or there are none.
+        bool GetBoundingBox(BoundingBox& box) const
+        {
+            if (nodes.empty() || !unboundedList.empty())
+            {
+                return false;
+            }
+            box = nodes[0].box;
+            return true;
+        }
+
+        // How many rays FindClosestSpheres traces together on this
+        // processor: 8 with AVX-512, or 4 with AVX2.  Zero means that
+        // it cannot be used, because the processor has neither, or 
+        // because the tree holds solids other than spheres.
+        int GetPacketWidth() const
+        {
+            return packetWidth;
+        }
+
+        // For 'count' rays from the same vantage point, up to the 
+        // packet width, sets closest[k] to the sphere that the ray
+        // along directions[k] meets first, or NULL if it meets none.
+        // The sphere's own FindClosestIntersection gives the point 
+        // at which the ray meets it.  If the ray meets another sphere
+        // at so nearly the same distance that the two may tie, tied[k]
+        // is set, and the ray must be traced with FindClosestIntersection
+        // instead, which finds any tie between solids.
+        void FindClosestSpheres(
+            const Vector& vantage,
+            const Vector* directions,
+            int count,
+            const SolidObject** closest,
+            bool* tied) const;
+
+    private:
+        struct Node
+        {
+            BoundingBox box;
+
+            // For a leaf, the range of solidList it holds.  For any
+            // other node, solidCount is zero, the first child is the
+            // next node, and the second is at secondChild.
+            size_t firstSolid;
+            size_t solidCount;
+            size_t secondChild;
+
+            // The axis (0=x, 1=y, 2=z) along which the children were 
+            // split.  The first child holds the solids with lower 
+            // coordinates along it.
+            int axis;
+        };
+
+        struct BuildItem
+        {
+            const SolidObject* solid;
+            BoundingBox box;
+            Vector center;
+        };
+
+        void BuildNode(std::vector<BuildItem>& items, size_t first, size_t count);
+        void BuildSphereArrays();
+
+        std::vector<Node> nodes;
+
+        // Kept from one Build to the next, so as not to allocate it
+        // again each time.
+        std::vector<BuildItem> buildItems;
+
+        // The bounded solids, in the order the leaves refer to them.
+        std::vector<const SolidObject*> solidList;
+
+        // The solids with no bounding box.
+        std::vector<const SolidObject*> unboundedList;
+
+        // If every solid is a Sphere, their centres and squared radii,
+        // in the same order as solidList, for FindClosestSpheres to 
+        // read straight through without calling the solids.
+        int packetWidth;
+        std::vector<double> sphereX;
+        std::vector<double> sphereY;
+        std::vector<double> sphereZ;
+        std::vector<double> sphereRadiusSquared;
+    };
+
+    //------------------------------------------------------------------------
+
     // The Scene object renders a collection of SolidObjects and 
     // LightSources that illuminate them.
     // SolidObjects are added one by one using the method AddSolidObject.
@@ -915,6 +1349,18 @@ namespace Imager
         explicit Scene(const Color& _backgroundColor = Color())
             : backgroundColor(_backgroundColor)
             , ambientRefraction(REFRACTION_VACUUM)
+            , pool(NULL)
+            , adaptiveAntiAliasing(false)
+            , refinedPixelCount(0)
+            , incrementalImage(NULL)
+            , tracedTileCount(0)
+            , tileCount(0)
+            , bvhStale(true)
+            , bvhLayoutSerial(0)
+            , renderTimes()
+            , ambiguousPixelCount(0)
+            , rayCounters()
+            , renderSerial(0)
             , activeDebugPoint(NULL)
         {
         }
@@ -929,6 +1375,7 @@ namespace Imager
         SolidObject& AddSolidObject(SolidObject* solidObject)
         {
             solidObjectList.push_back(solidObject);
+            bvhStale = true;    // KB
             return *solidObject;
         }
 
@@ -958,6 +1405,111 @@ namespace Imager
             double zoom, 
             size_t antiAliasFactor) const;
 
+        // KB -- SaveImage traces the image in square tiles, which are
+        // shared out among the workers of the given thread pool.
+        // The pool must outlive this scene, or be replaced by another
+        // call.  NULL (the default) renders on the calling thread.
+        void SetThreadPool(ThreadPool* _pool)
+        {
+            pool = _pool;
+        }
+
+        // KB -- With adaptive anti-aliasing, SaveImage first traces one
+        // ray for each pixel.  Only pixels that differ from one of
+        // their neighbors, in the solid they show or by more than a 
+        // little in color, are then traced at the full anti-aliasing 
+        // factor.  Elsewhere, one ray stands for all of them.  This 
+        // has no effect when the anti-aliasing factor is 1.
+        void SetAdaptiveAntiAliasing(bool _adaptiveAntiAliasing)
+        {
+            adaptiveAntiAliasing = _adaptiveAntiAliasing;
+        }
+
+        // KB -- How many pixels of the last image were traced at the
+        // full anti-aliasing factor: all of them, unless adaptive 
+        // anti-aliasing is on.
+        size_t GetRefinedPixelCount() const
+        {
+            return refinedPixelCount;
+        }
+
+        // KB -- Keeps each image SaveImage makes in 'image', so that 
+        // the next time only the tiles that the changes the caller has
+        // reported there could affect need be traced: those in which
+        // the changed places can be seen, or in which their shadows 
+        // may fall.  This is only done if every solid is opaque and 
+        // matte, since otherwise a change can show up anywhere by 
+        // reflection, and not with adaptive anti-aliasing; otherwise
+        // every image is traced in full.  The image must outlive this
+        // scene, or be replaced by another call.  NULL (the default) 
+        // keeps nothing.
+        void SetIncrementalImage(IncrementalImage* _incrementalImage)
+        {
+            incrementalImage = _incrementalImage;
+        }
+
+        // KB -- How many tiles of the last image were traced, and how
+        // many there were in all.
+        size_t GetTracedTileCount() const
+        {
+            return tracedTileCount;
+        }
+
+        size_t GetTileCount() const
+        {
+            return tileCount;
+        }
+
+        // KB -- How long each stage of the last call to SaveImage took,
+        // in milliseconds.
+        struct RenderTimes
+        {
+            double bvhBuild;    // building the bounding volume hierarchy
+            double trace;       // choosing tiles, and tracing rays
+            double heal;        // making up ambiguous pixels
+            double maxColor;    // finding the brightest color component
+            double downsample;  // averaging samples into pixels
+            double blit;        // writing the pixels to the framebuffer
+        };
+
+        const RenderTimes& GetRenderTimes() const
+        {
+            return renderTimes;
+        }
+
+        // KB -- SaveImage keeps a bounding volume hierarchy over the
+        // visible solids, and builds it again only when solids have been
+        // added, shown, hidden, or translated since the last image.  A
+        // caller that rotates a solid already drawn must call this, so
+        // that the next image builds it afresh.
+        void SolidsMoved()
+        {
+            bvhStale = true;
+        }
+
+        // KB -- How long SaveImage took, the last time, to build the
+        // bounding volume hierarchy, in milliseconds; zero if it did
+        // not need to.
+        double GetBvhBuildMilliseconds() const
+        {
+            return renderTimes.bvhBuild;
+        }
+
+        // KB -- How many of the pixels of the last image, before
+        // downsampling, had to be made up from their neighbors because
+        // their rays met ties between intersections.
+        size_t GetAmbiguousPixelCount() const
+        {
+            return ambiguousPixelCount;
+        }
+
+        // KB -- What the ray tracer did for the last image, added up
+        // over all the threads.  All zero unless RAYTRACE_COUNTERS is 1.
+        const RayCounters& GetRayCounters() const
+        {
+            return rayCounters;
+        }
+
         // By default, regions of space that are not
         // explicitly occupied by some object have
         // the refractive index of vacuum, or
@@ -987,38 +1539,69 @@ namespace Imager
 
         bool HasClearLineOfSight(
             const Vector& point1, 
-            const Vector& point2) const;
-
-        Color TraceRay(
+            const Vector& point2,
+            size_t lightIndex) const;
+
+        // KB -- TraceRay and the functions it calls to follow a ray
+        // return false if, anywhere along the ray's path, there is 
+        // more than one intersection at the same minimum distance.
+        // That can be really bad, for example causing a ray of light
+        // to reflect inward into a solid, so outColor is then left
+        // unset, and SaveImage makes up the pixel's color from its 
+        // neighbors instead.  (These used to throw an exception, but
+        // unwinding a deep recursion for each grazing ray is slow.)
+        bool TraceRay(
             const Vector& vantage,
             const Vector& direction,
             double refractiveIndex,
             Color rayIntensity,
-            int recursionDepth) const;
+            int recursionDepth,
+            Color& outColor) const;
 
-        Color CalculateLighting(
+        // KB -- The part of TraceRay after the closest intersection
+        // has been found.
+        bool TraceFromIntersection(
+            int numClosest,
+            const Intersection& intersection,
+            const Vector& direction,
+            double refractiveIndex,
+            Color rayIntensity,
+            int recursionDepth,
+            Color& outColor) const;
+
+        bool CalculateLighting(
             const Intersection& intersection, 
             const Vector& direction, 
             double refractiveIndex,
             Color rayIntensity,
-            int recursionDepth) const;
+            int recursionDepth,
+            Color& outColor) const;
+
+        // KB -- As TraceFromIntersection for a ray from the camera, 
+        // when every solid is opaque and matte.
+        bool ShadeOpaqueMatte(
+            int numClosest,
+            const Intersection& intersection,
+            Color& outColor) const;
 
         Color CalculateMatte(const Intersection& intersection) const;
 
-        Color CalculateReflection(
+        bool CalculateReflection(
             const Intersection& intersection, 
             const Vector& incidentDir, 
             double refractiveIndex,
             Color rayIntensity,
-            int recursionDepth) const;
+            int recursionDepth,
+            Color& outColor) const;
 
-        Color CalculateRefraction(
+        bool CalculateRefraction(
             const Intersection& intersection, 
             const Vector& direction, 
             double sourceRefractiveIndex,
             Color rayIntensity,
             int recursionDepth,
-            double& outReflectionFactor) const;
+            double& outReflectionFactor,
+            Color& outColor) const;
 
         const SolidObject* PrimaryContainer(const Vector& point) const;
 
@@ -1030,6 +1613,17 @@ namespace Imager
 
         void ResolveAmbiguousPixel(ImageBuffer& buffer, size_t i, size_t j) const;
 
+        struct RenderJob;
+        static void RenderTiles(int worker, int workers, void* data);
+        size_t FindEdgePixels(const ImageBuffer& buffer, RenderJob& job) const;
+        void FillSmoothPixels(ImageBuffer& buffer, const RenderJob& job) const;
+        bool FindChangedTiles(
+            const IncrementalImage& image,
+            double largeZoom,
+            size_t tilesWide,
+            size_t tilesHigh,
+            std::vector<size_t>& changedTiles) const;
+
         // Convert a floating point color component value, 
         // based on the maximum component value,
         // to a byte RGB value in the range 0x00 to 0xff.
@@ -1089,9 +1683,34 @@ namespace Imager
         // like water.
         double ambientRefraction;
 
-        // Help performance by avoiding constant construction/destruction
-        // of intersection lists.
-        mutable IntersectionList cachedIntersectionList;
+        // The threads that SaveImage shares the tracing among, if any.
+        ThreadPool* pool;
+
+        bool adaptiveAntiAliasing;
+        mutable size_t refinedPixelCount;
+
+        IncrementalImage* incrementalImage;
+        mutable size_t tracedTileCount;
+        mutable size_t tileCount;
+
+        // Rebuilt by SaveImage, before any rays are traced, if bvhStale
+        // is set, or the solids' layout serial is not the one it was 
+        // last built at.
+        mutable BoundingVolumeHierarchy bvh;
+        mutable bool bvhStale;
+        mutable unsigned long bvhLayoutSerial;
+        mutable RenderTimes renderTimes;
+
+        // The last image after downsampling, as red, green, and blue
+        // bytes for each pixel, by row.
+        mutable std::vector<unsigned char> downsampled;
+        mutable size_t ambiguousPixelCount;
+        mutable RayCounters rayCounters;
+
+        // A number that no other call to SaveImage, on this or any
+        // other scene, has used.  It tells the per-thread caches of
+        // shadowing solids when what they hold is out of date.
+        mutable unsigned long renderSerial;
 
         struct DebugPoint
         {
@@ -1117,9 +1736,17 @@ namespace Imager
         Color   color;
         bool    isAmbiguous;
 
+        // KB -- The solid, and its context, at the closest intersection
+        // of the ray from the camera, or NULL if it hit nothing.  
+        // Adaptive anti-aliasing looks for pixels where these change.
+        const SolidObject* solid;
+        const void* context;
+
         PixelData()
             : color()
             , isAmbiguous(false)
+            , solid(NULL)
+            , context(NULL)
         {
         }
     };
@@ -1212,6 +1839,58 @@ namespace Imager
         PixelData*  array;      // flattened array [pixelsWide * pixelsHigh].
     };
 
+    //------------------------------------------------------------------------
+    // KB -- Lets Scene::SaveImage re-trace only the parts of an image 
+    // that may differ from the last one it made with the same 
+    // IncrementalImage (see Scene::SetIncrementalImage).  Between the 
+    // two, the caller reports each place where a solid appeared, 
+    // vanished, or changed color, by calling Invalidate.  The camera,
+    // the lights, and everything else must be as they were.
+    class IncrementalImage
+    {
+    public:
+        IncrementalImage()
+            : buffer(NULL)
+            , zoom(0.0)
+            , antiAliasFactor(0)
+        {
+        }
+
+        ~IncrementalImage()
+        {
+            delete buffer;
+        }
+
+        // Notes that anything inside 'box' may have changed.
+        void Invalidate(const BoundingBox& box)
+        {
+            changes.push_back(box);
+        }
+
+        // Forgets the last image, so that the next is traced in full.
+        void Reset()
+        {
+            delete buffer;
+            buffer = NULL;
+            changes.clear();
+        }
+
+    private:
+        friend class Scene;
+
+        IncrementalImage(const IncrementalImage&);
+        IncrementalImage& operator= (const IncrementalImage&);
+
+        // The oversampled image last traced, or NULL if there is none,
+        // and the settings it was traced with.
+        ImageBuffer* buffer;
+        double zoom;
+        size_t antiAliasFactor;
+
+        // What has changed since.
+        std::vector<BoundingBox> changes;
+    };
+
     // Output operators (print helpful debug information).
     std::ostream& operator<< (std::ostream&, const Color&);
     std::ostream& operator<< (std::ostream&, const Vector&);
@@ -11,20 +11,135 @@
 #include <stdio.h> 
 #include <stdlib.h> 
 #include <time.h> 
+#include <string.h> 
+#include <limits.h> 
+#include <utility>
 #include "life3d.h"
+#include "life3drule.h"
+#include "threadpool.h"
+#include "hashlife.h"
+#include "log.h"
+
+// Each worker thread in the bit-packed engine needs this many planes
+//   of scratch -- see step_bits_slab()
+#define BIT_SCRATCH_PLANES 15
+
+// In the "auto" engine, switch to the sparse method when fewer than
+//   this proportion of cells are alive, and back to the dense method
+//   when more than DENSE_DENSITY are. The gap stops the engine
+//   flipping back and forth around a single threshold. The sparse
+//   method visits up to 27 cells for each live cell, and counts
+//   neighbours for each, so it stops paying off at a few percent.
+#define SPARSE_DENSITY 0.02
+#define DENSE_DENSITY 0.04
+
+// Default memory for the HashLife node cache
+#define DEFAULT_CACHE_LIMIT (256 * 1024 * 1024)
+
+/*===========================================================================
+
+  grid_alloc
+
+  Allocate zeroed memory for count items. The grid can be very large, 
+  and there is nothing useful to be done without it, so if there is
+  not enough memory, stop.
+
+===========================================================================*/
+static void *grid_alloc (size_t count, size_t item_size)
+  {
+  void *p = calloc (count, item_size);
+  if (!p)
+    {
+    log_error ("Can't allocate %lu bytes for the grid\n", 
+      (unsigned long)(count * item_size));
+    exit (1);
+    }
+  return p;
+  }
 
 /*===========================================================================
 
   Life3D constructor
 
 ===========================================================================*/
-Life3D::Life3D (int size, double filling)
+Life3D::Life3D (int size_x, int size_y, int size_z, double filling, 
+    Life3DEngine engine, Life3DBoundary boundary)
   {
-  cells = (int *)malloc (size * size * size * sizeof (int));
-  // Precompute this, to speed up some array indexing operations
-  size_squared = size * size;
-  this->size = size;
+  if (engine == LIFE3D_ENGINE_HASHLIFE && (size_x != size_y 
+       || size_x != size_z || !HashLife3D::size_ok (size_x)))
+    {
+    log_warning ("HashLife needs a cubic grid whose size is a power of two;"
+      " using the dense engine");
+    engine = LIFE3D_ENGINE_DENSE;
+    }
+  if (engine == LIFE3D_ENGINE_HASHLIFE && boundary != LIFE3D_BOUNDARY_TORUS)
+    {
+    log_warning ("HashLife needs a toroidal boundary;"
+      " using the dense engine");
+    engine = LIFE3D_ENGINE_DENSE;
+    }
+
+  this->size_x = size_x;
+  this->size_y = size_y;
+  this->size_z = size_z;
+  // Precompute these, to speed up some array indexing operations
+  volume = (size_t)size_x * size_y * size_z;
+  stride_y = (size_t)size_z + 2;
+  stride_x = stride_y * (size_y + 2);
+  int k = 0;
+  for (int dx = -1; dx <= 1; dx++)
+    for (int dy = -1; dy <= 1; dy++)
+      for (int dz = -1; dz <= 1; dz++)
+        if (dx || dy || dz)
+          neighbour_offset[k++] = dx * (long)stride_x 
+            + dy * (long)stride_y + dz;
+
+  size_t padded = stride_x * (size_x + 2);
+  cells = (int *)grid_alloc (padded, sizeof (int));
+  next_cells = NULL;
   this->filling = filling;
+  this->engine = engine;
+  this->boundary = boundary;
+  pool = NULL;
+  population = 0;
+  slab_population = (size_t *)calloc (1, sizeof (size_t));
+  hash = 0;
+  slab_hash = (uint64_t *)calloc (1, sizeof (uint64_t));
+  history_len = 0;
+  history_pos = 0;
+  stamp = NULL;
+  stamp_gen = 0;
+  live_valid = false;
+  hashlife = NULL;
+  cache_limit = DEFAULT_CACHE_LIMIT;
+  bits = NULL;
+  next_bits = NULL;
+  bit_scratch = NULL;
+  bit_scratch_words = 0;
+  words_per_row = (size_z + 63) / 64;
+  count_scratch = NULL;
+  count_scratch_bytes = 0;
+  counting = LIFE3D_COUNTING_SEPARABLE;
+  Life3DRule rule = { LIFE3D_MASK2 (4, 5), LIFE3D_MASK3 (5, 6, 7) };
+  set_rule (rule);
+  if (engine == LIFE3D_ENGINE_DENSE || engine == LIFE3D_ENGINE_AUTO)
+    {
+    next_cells = (int *)grid_alloc (padded, sizeof (int));
+    // See step_separable_slab()
+    count_scratch_bytes = ((size_t)size_y + 2 + 3 * (size_t)size_y) * size_z;
+    count_scratch = (unsigned char *)grid_alloc (count_scratch_bytes, 1);
+    }
+  if (engine == LIFE3D_ENGINE_SPARSE || engine == LIFE3D_ENGINE_AUTO)
+    stamp = (unsigned *)grid_alloc (padded, sizeof (unsigned));
+  if (engine == LIFE3D_ENGINE_BITS)
+    {
+    size_t words = (size_t)size_x * size_y * words_per_row;
+    bits = (uint64_t *)grid_alloc (words, sizeof (uint64_t));
+    next_bits = (uint64_t *)grid_alloc (words, sizeof (uint64_t));
+    bit_scratch_words = (size_t)BIT_SCRATCH_PLANES * size_y * words_per_row;
+    bit_scratch = (uint64_t *)grid_alloc (bit_scratch_words, 
+      sizeof (uint64_t));
+    }
   }
 
 /*===========================================================================
@@ -35,6 +150,15 @@ Life3D::Life3D (int size, double filling)
 Life3D::~Life3D (void)
   {
   free (cells);
+  free (next_cells);
+  free (bits);
+  free (next_bits);
+  free (bit_scratch);
+  free (count_scratch);
+  free (slab_population);
+  free (slab_hash);
+  free (stamp);
+  delete hashlife;
   }
 
 /*===========================================================================
@@ -44,18 +168,30 @@ Life3D::~Life3D (void)
 ===========================================================================*/
 void Life3D::seed (void)
   {
-  int l = size_squared * size;
-
-  for (int i = 0; i < l; i++)
+  for (int x = 0; x < size_x; x++)
     {
-    double r = rand() / (double) RAND_MAX;
-    if (r > (1.0 - filling))
+    for (int y = 0; y < size_y; y++)
       {
-      cells[i] = 1; 
+      int *row = cells + index (x, y, 0);
+      for (int z = 0; z < size_z; z++)
+        {
+        double r = rand() / (double) RAND_MAX;
+        if (r > (1.0 - filling))
+          {
+          row[z] = 1; 
+          }
+        else
+          row[z] = 0; 
+        }
       }
-    else
-      cells[i] = 0; 
     }
+  fill_halo();
+  if (engine == LIFE3D_ENGINE_BITS) pack_bits();
+  population = count_population();
+  hash = count_hash();
+  history_len = 0;
+  remember_hash();
+  live_valid = false;
   }
 
 /*===========================================================================
@@ -65,7 +201,7 @@ void Life3D::seed (void)
 ===========================================================================*/
 bool Life3D::is_alive (int x, int y, int z) const
   {
-  return cells [x * size_squared + y * size + z];
+  return cells [index (x, y, z)];
   }
 
 /*===========================================================================
@@ -75,139 +211,498 @@ bool Life3D::is_alive (int x, int y, int z) const
 ===========================================================================*/
 int Life3D::get_age (int x, int y, int z) const
   {
-  return cells [x * size_squared + y * size + z];
+  return cells [index (x, y, z)];
   }
 
 /*===========================================================================
 
-  Life3D::die
+  Life3D::edge_source
 
 ===========================================================================*/
-void Life3D::die (int x, int y, int z) 
+int Life3D::edge_source (int n, int extent) const
   {
-  cells [x * size_squared + y * size + z] = 0;
+  if (n >= 0 && n < extent) return n;
+  switch (boundary)
+    {
+    case LIFE3D_BOUNDARY_TORUS:
+      return n < 0 ? extent - 1 : 0;
+    case LIFE3D_BOUNDARY_MIRROR:
+      return n < 0 ? 0 : extent - 1;
+    default:
+      return -1;
+    }
   }
 
 /*===========================================================================
 
-  Life3D::spawn
+  Life3D::fill_halo
+
+  Copy into the halo the cells that lie across each face. The z faces
+  are done first, then the y faces including their z halo, then the x 
+  faces including both, so that the edges and corners come out right.
 
 ===========================================================================*/
-void Life3D::spawn (int x, int y, int z) 
+void Life3D::fill_halo (void)
   {
-  cells [x * size_squared + y * size + z] = 1;
+  int zlo = edge_source (-1, size_z);
+  int zhi = edge_source (size_z, size_z);
+  for (int x = 0; x < size_x; x++)
+    {
+    for (int y = 0; y < size_y; y++)
+      {
+      int *row = cells + index (x, y, 0);
+      row[-1] = zlo < 0 ? 0 : row[zlo];
+      row[size_z] = zhi < 0 ? 0 : row[zhi];
+      }
+    }
+
+  for (int x = 0; x < size_x; x++)
+    {
+    for (int y = -1; y <= size_y; y += size_y + 1)
+      {
+      int src = edge_source (y, size_y);
+      int *row = cells + index (x, y, -1);
+      if (src < 0)
+        memset (row, 0, stride_y * sizeof (int));
+      else
+        memcpy (row, cells + index (x, src, -1), stride_y * sizeof (int));
+      }
+    }
+
+  for (int x = -1; x <= size_x; x += size_x + 1)
+    {
+    int src = edge_source (x, size_x);
+    int *plane = cells + index (x, -1, -1);
+    if (src < 0)
+      memset (plane, 0, stride_x * sizeof (int));
+    else
+      memcpy (plane, cells + index (src, -1, -1), stride_x * sizeof (int));
+    }
   }
 
 /*===========================================================================
 
-  Life3D::constrain
+  Life3D::neighbours
 
 ===========================================================================*/
-int Life3D::constrain (int n) const
+int Life3D::neighbours (int x, int y, int z) const
   {
-  if (n > size) return 0;
-  if (n < 0) return size - 1;
+  const int *c = cells + index (x, y, z);
+  int n = 0;
+  for (int k = 0; k < 26; k++)
+    n += c[neighbour_offset[k]] != 0;
   return n;
   }
 
 /*===========================================================================
 
-  Life3D::increment age
+  Life3D::step
+
+  The new generation is written to next_cells, reading only from
+  cells, and then the two are swapped. So every cell's fate is decided
+  by the same, complete, previous generation. That also means that the
+  grid can be divided into slabs of x planes, each worked on by a
+  separate thread.
 
 ===========================================================================*/
-void Life3D::increment_age (int x, int y, int z) 
+void Life3D::step (void)
   {
-  cells [x * size_squared + y * size + z]++;
+  if (engine == LIFE3D_ENGINE_HASHLIFE)
+    {
+    advance_hashlife (1);
+    return;
+    }
+  if (use_sparse())
+    {
+    step_sparse();
+    remember_hash();
+    return;
+    }
+  live_valid = false;
+
+  if (pool)
+    pool->run (step_job, this);
+  else
+    step_job (0, 1, this);
+
+  int workers = pool ? pool->get_threads() : 1;
+  population = 0;
+  for (int i = 0; i < workers; i++)
+    {
+    population += slab_population[i];
+    hash ^= slab_hash[i];
+    }
+
+  if (engine == LIFE3D_ENGINE_BITS)
+    {
+    uint64_t *t = bits;
+    bits = next_bits;
+    next_bits = t;
+    }
+  else
+    {
+    int *t = cells;
+    cells = next_cells;
+    next_cells = t;
+    }
+  fill_halo();
+  remember_hash();
   }
 
 /*===========================================================================
 
-  Life3D::neighbours
+  Life3D::advance
 
 ===========================================================================*/
-int Life3D::neighbours (int x, int y, int z) const
+void Life3D::advance (long gens)
   {
-  int c = 0;
-
-  int xup = constrain (x + 1); 
-  int xdown = constrain (x - 1);
-  int yup = constrain (y + 1);
-  int ydown = constrain (y - 1);
-  int zup = constrain (z + 1);
-  int zdown = constrain (z - 1);
-
-  c += is_alive (xup, y, z);
-  c += is_alive (xdown, y, z);
-  c += is_alive (xup, yup, z);
-  c += is_alive (xdown, yup, z);
-  c += is_alive (xup, ydown, z);
-  c += is_alive (xdown, ydown, z);
-  c += is_alive (x, yup, z);
-  c += is_alive (x, ydown, z);
-
-  c += is_alive (xup, y, zup);
-  c += is_alive (xdown, y, zup);
-  c += is_alive (xup, yup, zup);
-  c += is_alive (xdown, yup, zup);
-  c += is_alive (xup, ydown, zup);
-  c += is_alive (xdown, ydown, zup);
-  c += is_alive (x, yup, zup);
-  c += is_alive (x, ydown, zup);
-  c += is_alive (x, y, zup);
-
-  c += is_alive (xup, y, zdown);
-  c += is_alive (xdown, y, zdown);
-  c += is_alive (xup, yup, zdown);
-  c += is_alive (xdown, yup, zdown);
-  c += is_alive (xup, ydown, zdown);
-  c += is_alive (xdown, ydown, zdown);
-  c += is_alive (x, yup, zdown);
-  c += is_alive (x, ydown, zdown);
-  c += is_alive (x, y, zdown);
-
-  return c;
+  if (engine == LIFE3D_ENGINE_HASHLIFE)
+    advance_hashlife (gens);
+  else
+    {
+    for (long i = 0; i < gens; i++)
+      step();
+    }
   }
 
 /*===========================================================================
 
-  Life3D::step
+  Life3D::advance_hashlife
+
+===========================================================================*/
+void Life3D::advance_hashlife (long gens)
+  {
+  if (!hashlife) hashlife = new HashLife3D (cache_limit);
+
+  // HashLife wants the cells without the halo
+  unsigned char *alive = (unsigned char *)grid_alloc (volume, 1);
+  unsigned char *a = alive;
+  for (int x = 0; x < size_x; x++)
+    for (int y = 0; y < size_y; y++)
+      {
+      const int *row = cells + index (x, y, 0);
+      for (int z = 0; z < size_z; z++)
+        *a++ = row[z] != 0;
+      }
+
+  // The constructor made sure the grid is a cube
+  hashlife->set_rule (rule.birth, rule.survive);
+  hashlife->advance (alive, size_x, gens);
+
+  population = 0;
+  hash = 0;
+  a = alive;
+  for (int x = 0; x < size_x; x++)
+    for (int y = 0; y < size_y; y++)
+      {
+      int *row = cells + index (x, y, 0);
+      for (int z = 0; z < size_z; z++)
+        {
+        if (*a++)
+          {
+          long age = row[z] ? row[z] + gens : 1;
+          row[z] = age > INT_MAX ? INT_MAX : (int)age;
+          population++;
+          hash ^= cell_key (index (x, y, z));
+          }
+        else
+          row[z] = 0;
+        }
+      }
+  free (alive);
+  fill_halo();
+  remember_hash();
+  }
 
-  This is a good place to edit the game rules. At present, the rules are
-  the same as those for the 2D version, except with different neighbour
-  counts, to account for the larger number of potential neighbours.
+/*===========================================================================
+
+  Life3D::set_cache_limit
 
 ===========================================================================*/
-void Life3D::step (void)
+void Life3D::set_cache_limit (size_t bytes)
+  {
+  cache_limit = bytes;
+  // Start again with the new limit next time it's needed
+  delete hashlife;
+  hashlife = NULL;
+  }
+
+/*===========================================================================
+
+  Life3D::step_job
+
+  Called on each thread of the pool, to work out one slab of x planes
+
+===========================================================================*/
+void Life3D::step_job (int worker, int workers, void *data)
   {
-  for (int x = 0; x < size; x++)
+  Life3D *self = (Life3D *)data;
+  int x0 = (int)((long)self->size_x * worker / workers);
+  int x1 = (int)((long)self->size_x * (worker + 1) / workers);
+
+  self->slab_population[worker] = 0;
+  self->slab_hash[worker] = 0;
+  if (x0 == x1) return;
+
+  if (self->engine == LIFE3D_ENGINE_BITS)
+    self->slab_population[worker] = (self->*self->bits_kernel) (x0, x1, 
+      self->bit_scratch + worker * self->bit_scratch_words,
+      &self->slab_hash[worker]);
+  else
+    self->slab_population[worker] = (self->*self->dense_kernel) (x0, x1, 
+      self->count_scratch + worker * self->count_scratch_bytes,
+      &self->slab_hash[worker]);
+  }
+
+/*===========================================================================
+
+  Life3D::step_dense_slab
+
+  Returns the number of cells alive in the slab in the new generation,
+  and sets changed to the XOR of the keys of the cells that were born
+  or died. Rule is one of the classes in life3drule.h, which decides
+  whether a cell with a given number of neighbours is born or survives.
+  The halo must be up to date, so that every cell's neighbours can
+  be found at the same offsets, without any tests for the edges.
+
+===========================================================================*/
+template <class Rule> size_t Life3D::step_dense_slab (int x0, int x1, 
+    unsigned char *scratch, uint64_t *changed)
+  {
+  (void)scratch;
+  Rule test (transition);
+  const long *offset = neighbour_offset;
+  size_t alive = 0;
+  uint64_t h = 0;
+  for (int x = x0; x < x1; x++)
     {
-    for (int y = 0; y < size; y++)
+    for (int y = 0; y < size_y; y++)
       {
-      for (int z = 0; z < size; z++)
+      size_t i = index (x, y, 0);
+      for (int z = 0; z < size_z; z++, i++)
         {
-	int n = neighbours (x, y, z);
-	if (is_alive (x, y, z))
-	  {
-	  increment_age (x, y, z);
-	  // There is a cell in this position. Work out whether it
-	  //   will die in this generation
-	  if (n < 5 || n > 7)
-	    {
-	    die (x, y, z);
-	    }
-	  }
-	else
-	  {
-	  // No cell in this position yet. Work out whether one will spawn
-	  //   in this generation
-	  if (n == 4 || n == 5)
-	    {
-	    spawn (x, y, z);
-	    }
-	  }
+        const int *c = cells + i;
+        int n = 0;
+        for (int k = 0; k < 26; k++)
+          n += c[offset[k]] != 0;
+        int age = cells[i];
+        if (age)
+          {
+          // There is a cell in this position. It gets older, unless
+          //   it dies in this generation
+          if (test.survives (n))
+            {
+            next_cells[i] = age + 1;
+            alive++;
+            }
+          else
+            {
+            next_cells[i] = 0;
+            h ^= cell_key (i);
+            }
+          }
+        else
+          {
+          // No cell in this position yet. Work out whether one will 
+          //   spawn in this generation
+          if (test.born (n))
+            {
+            next_cells[i] = 1;
+            alive++;
+            h ^= cell_key (i);
+            }
+          else
+            next_cells[i] = 0;
+          }
         }
       }
     }
+  *changed = h;
+  return alive;
+  }
+
+/*===========================================================================
+
+  Life3D::step_separable_slab
+
+  The same as step_dense_slab(), but with the neighbour counts worked
+  out as box sums, one axis at a time. Each plane of x is first
+  reduced to sums of three cells along z (for every row of the plane,
+  including the halo rows), and then to sums of three of those along y.
+  The yz sums are kept for the last three planes, in a ring, so the
+  count for a cell in the middle plane is the sum of three of them,
+  less the cell itself. Every plane is summed only once, and the
+  only memory touched besides the cells is a few planes of bytes,
+  which fit in the cache. scratch must have room for 
+  count_scratch_bytes bytes.
+
+===========================================================================*/
+template <class Rule> size_t Life3D::step_separable_slab (int x0, int x1, 
+    unsigned char *scratch, uint64_t *changed)
+  {
+  Rule test (transition);
+  uint64_t h = 0;
+  size_t plane = (size_t)size_y * size_z;
+  // z sums for the size_y + 2 rows of one plane, then three planes of
+  //   yz sums
+  unsigned char *zsum = scratch;
+  unsigned char *yzsum = scratch + ((size_t)size_y + 2) * size_z;
+  size_t alive = 0;
+
+  // The yz sums for plane x0 - 1 + i go into ring slot i % 3
+  #define YZSUM(i) (yzsum + ((i) % 3) * plane)
+  for (int i = 0; i < x1 - x0 + 2; i++)
+    {
+    int px = x0 - 1 + i;
+    for (int y = -1; y <= size_y; y++)
+      {
+      const int *row = cells + index (px, y, 0);
+      unsigned char *zs = zsum + (size_t)(y + 1) * size_z;
+      for (int z = 0; z < size_z; z++)
+        zs[z] = (row[z - 1] != 0) + (row[z] != 0) + (row[z + 1] != 0);
+      }
+    unsigned char *ys = YZSUM(i);
+    for (int y = 0; y < size_y; y++)
+      {
+      const unsigned char *a = zsum + (size_t)y * size_z;
+      const unsigned char *b = a + size_z;
+      const unsigned char *c = b + size_z;
+      unsigned char *out = ys + (size_t)y * size_z;
+      for (int z = 0; z < size_z; z++)
+        out[z] = a[z] + b[z] + c[z];
+      }
+
+    // Once we have three consecutive planes, we can finish the
+    //   middle one
+    if (i < 2) continue;
+    int tx = x0 + i - 2;
+    const unsigned char *pa = YZSUM(i - 2);
+    const unsigned char *pb = YZSUM(i - 1);
+    const unsigned char *pc = YZSUM(i);
+    for (int y = 0; y < size_y; y++)
+      {
+      size_t o = (size_t)y * size_z;
+      const int *old_row = cells + index (tx, y, 0);
+      int *new_row = next_cells + index (tx, y, 0);
+      for (int z = 0; z < size_z; z++)
+        {
+        int age = old_row[z];
+        int n = pa[o + z] + pb[o + z] + pc[o + z] - (age != 0);
+        if (age)
+          {
+          if (test.survives (n))
+            {
+            new_row[z] = age + 1;
+            alive++;
+            }
+          else
+            {
+            new_row[z] = 0;
+            h ^= cell_key (index (tx, y, z));
+            }
+          }
+        else
+          {
+          if (test.born (n))
+            {
+            new_row[z] = 1;
+            alive++;
+            h ^= cell_key (index (tx, y, z));
+            }
+          else
+            new_row[z] = 0;
+          }
+        }
+      }
+    }
+  #undef YZSUM
+  *changed = h;
+  return alive;
+  }
+
+/*===========================================================================
+
+  Life3D::set_rule
+
+  Build the transition table, and pick the kernels to suit it
+
+===========================================================================*/
+void Life3D::set_rule (const Life3DRule &rule)
+  {
+  this->rule = rule;
+  if (this->rule.birth & 1)
+    {
+    log_warning ("Cells cannot be born with no neighbours; ignoring B0");
+    this->rule.birth &= ~1U;
+    }
+  for (int n = 0; n < 27; n++)
+    {
+    transition[n] = 0;
+    if (this->rule.birth & (1U << n)) transition[n] |= LIFE3D_BORN;
+    if (this->rule.survive & (1U << n)) transition[n] |= LIFE3D_SURVIVES;
+    }
+  pick_kernels();
+  }
+
+/*===========================================================================
+
+  Life3D::set_counting
+
+===========================================================================*/
+void Life3D::set_counting (Life3DCounting counting)
+  {
+  this->counting = counting;
+  pick_kernels();
+  }
+
+/*===========================================================================
+
+  Life3D::pick_kernels
+
+  Pick the kernels for the rule and the counting method: the ones 
+  compiled specially for the rule, if it is one of the rules in
+  LIFE3D_FIXED_RULES, or else the ones that use the transition table.
+
+===========================================================================*/
+void Life3D::pick_kernels (void)
+  {
+  bool separable = counting == LIFE3D_COUNTING_SEPARABLE;
+  dense_kernel = separable ? &Life3D::step_separable_slab<TableRule>
+    : &Life3D::step_dense_slab<TableRule>;
+  bits_kernel = &Life3D::step_bits_slab<TableRule>;
+  #define LIFE3D_PICK_RULE(name, b, s) \
+  if (rule.birth == (b) && rule.survive == (s)) \
+    { \
+    dense_kernel = separable ? &Life3D::step_separable_slab<name> \
+      : &Life3D::step_dense_slab<name>; \
+    bits_kernel = &Life3D::step_bits_slab<name>; \
+    }
+  LIFE3D_FIXED_RULES (LIFE3D_PICK_RULE)
+  #undef LIFE3D_PICK_RULE
+  }
+
+/*===========================================================================
+
+  Life3D::set_thread_pool
+
+===========================================================================*/
+void Life3D::set_thread_pool (ThreadPool *pool)
+  {
+  this->pool = pool;
+  int workers = pool ? pool->get_threads() : 1;
+  slab_population = (size_t *)realloc (slab_population, 
+    workers * sizeof (size_t));
+  slab_hash = (uint64_t *)realloc (slab_hash, workers * sizeof (uint64_t));
+  if (engine == LIFE3D_ENGINE_BITS)
+    {
+    bit_scratch = (uint64_t *)realloc (bit_scratch, 
+      workers * bit_scratch_words * sizeof (uint64_t));
+    }
+  if (count_scratch)
+    {
+    count_scratch = (unsigned char *)realloc (count_scratch, 
+      workers * count_scratch_bytes);
+    }
   }
 
 /*===========================================================================
@@ -217,9 +712,335 @@ void Life3D::step (void)
 ===========================================================================*/
 bool Life3D::is_empty (void) const
   {
-  int l = size_squared * size;
-  for (int i = 0; i < l; i++)
-    if (cells[i]) return false;
+  return population == 0;
+  }
+
+/*===========================================================================
+
+  Life3D::snapshot
+
+===========================================================================*/
+void Life3D::snapshot (Life3DFrame &frame) const
+  {
+  frame.size_x = size_x;
+  frame.size_y = size_y;
+  frame.size_z = size_z;
+  frame.population = population;
+  frame.ages.resize (volume);
+  unsigned char *age = frame.ages.data();
+  for (int x = 0; x < size_x; x++)
+    for (int y = 0; y < size_y; y++)
+      {
+      const int *row = cells + index (x, y, 0);
+      for (int z = 0; z < size_z; z++)
+        *age++ = row[z] < 255 ? row[z] : 255;
+      }
+  }
+
+/*===========================================================================
+
+  Life3DFrame::swap
+
+===========================================================================*/
+void Life3DFrame::swap (Life3DFrame &other)
+  {
+  std::swap (size_x, other.size_x);
+  std::swap (size_y, other.size_y);
+  std::swap (size_z, other.size_z);
+  std::swap (population, other.population);
+  ages.swap (other.ages);
+  }
+
+/*===========================================================================
+
+  Life3DFrame::find_changes
+
+===========================================================================*/
+void Life3DFrame::find_changes (std::vector<unsigned char> &shown, 
+    int max_age, std::vector<Life3DCell> &changed) const
+  {
+  if (shown.size() != ages.size()) shown.assign (ages.size(), 0);
+  const unsigned char *age = ages.data();
+  unsigned char *seen = shown.data();
+  for (int x = 0; x < size_x; x++)
+    for (int y = 0; y < size_y; y++)
+      for (int z = 0; z < size_z; z++, age++, seen++)
+        {
+        const unsigned char capped = *age < max_age ? *age : max_age;
+        if (capped != *seen)
+          {
+          Life3DCell cell = { x, y, z };
+          changed.push_back (cell);
+          *seen = capped;
+          }
+        }
+  }
+
+/*===========================================================================
+
+  Life3D::count_population
+
+  Count the live cells the slow way. step() keeps population up to date,
+  so this is only needed after seeding.
+
+===========================================================================*/
+size_t Life3D::count_population (void) const
+  {
+  size_t n = 0;
+  for (int x = 0; x < size_x; x++)
+    for (int y = 0; y < size_y; y++)
+      {
+      const int *row = cells + index (x, y, 0);
+      for (int z = 0; z < size_z; z++)
+        if (row[z]) n++;
+      }
+  return n;
+  }
+
+/*===========================================================================
+
+  Life3D::count_hash
+
+  Work out the hash from scratch. Like count_population(), this is
+  only needed after seeding.
+
+===========================================================================*/
+uint64_t Life3D::count_hash (void) const
+  {
+  uint64_t h = 0;
+  for (int x = 0; x < size_x; x++)
+    for (int y = 0; y < size_y; y++)
+      {
+      size_t i = index (x, y, 0);
+      for (int z = 0; z < size_z; z++, i++)
+        if (cells[i]) h ^= cell_key (i);
+      }
+  return h;
+  }
+
+/*===========================================================================
+
+  Life3D::remember_hash
+
+  Add the present hash to the history, after each step
+
+===========================================================================*/
+void Life3D::remember_hash (void)
+  {
+  history_pos = (history_pos + 1) % LIFE3D_HISTORY;
+  history[history_pos] = hash;
+  if (history_len < LIFE3D_HISTORY) history_len++;
+  }
+
+/*===========================================================================
+
+  Life3D::get_period
+
+===========================================================================*/
+int Life3D::get_period (void) const
+  {
+  for (int k = 1; k < history_len; k++)
+    {
+    if (history[(history_pos - k + LIFE3D_HISTORY) % LIFE3D_HISTORY] 
+         == hash)
+      return k;
+    }
+  return 0;
+  }
+
+/*===========================================================================
+
+  Life3D::use_sparse
+
+  Decide whether the next step should use the sparse method
+
+===========================================================================*/
+bool Life3D::use_sparse (void)
+  {
+  if (engine == LIFE3D_ENGINE_SPARSE) return true;
+  if (engine != LIFE3D_ENGINE_AUTO) return false;
+
+  double density = population / (double)volume;
+  // Stay with whichever method we used last time, unless the density
+  //   has moved outside the band between the two thresholds
+  if (live_valid)
+    return density < DENSE_DENSITY;
+  return density < SPARSE_DENSITY;
+  }
+
+/*===========================================================================
+
+  parse_counts
+
+  Parse the neighbour counts between p and end, setting their bits in
+  mask. Returns false if they are not valid.
+
+===========================================================================*/
+static bool parse_counts (const char *p, const char *end, uint32_t *mask)
+  {
+  bool list = false;
+  for (const char *q = p; q < end; q++)
+    if (*q == ',' || *q == '-') list = true;
+
+  if (!list)
+    {
+    // Each digit is a count, as in "B45"
+    for (; p < end; p++)
+      {
+      if (*p < '0' || *p > '9') return false;
+      *mask |= 1U << (*p - '0');
+      }
+    return true;
+    }
+
+  // Items separated by commas, each a count or a range of counts
+  while (p < end)
+    {
+    int range[2];
+    for (int i = 0; i < 2; i++)
+      {
+      if (p == end || *p < '0' || *p > '9') return false;
+      range[i] = *p++ - '0';
+      if (p < end && *p >= '0' && *p <= '9')
+        range[i] = range[i] * 10 + *p++ - '0';
+      if (i == 0)
+        {
+        if (p < end && *p == '-')
+          p++;
+        else
+          {
+          range[1] = range[0];
+          break;
+          }
+        }
+      }
+    if (range[1] < range[0] || range[1] > 26) return false;
+    for (int n = range[0]; n <= range[1]; n++)
+      *mask |= 1U << n;
+    if (p < end)
+      {
+      if (*p != ',' || p + 1 == end) return false;
+      p++;
+      }
+    }
   return true;
   }
 
+/*===========================================================================
+
+  Life3D::rule_from_string
+
+===========================================================================*/
+bool Life3D::rule_from_string (const char *spec, Life3DRule *rule)
+  {
+  // The birth mask is masks[0], the survival mask masks[1]
+  uint32_t masks[2] = { 0, 0 };
+  bool seen[2] = { false, false };
+  const char *p = spec;
+  while (*p)
+    {
+    int which;
+    if (*p == 'B' || *p == 'b')
+      which = 0;
+    else if (*p == 'S' || *p == 's')
+      which = 1;
+    else
+      return false;
+    if (seen[which]) return false;
+    seen[which] = true;
+
+    p++;
+    const char *end = strchr (p, '/');
+    if (!end) end = p + strlen (p);
+    if (!parse_counts (p, end, &masks[which])) return false;
+    if (*end == '/' && end[1] == 0) return false;
+    p = *end ? end + 1 : end;
+    }
+  if (!seen[0] || !seen[1]) return false;
+  if (masks[0] & 1) return false;
+
+  rule->birth = masks[0];
+  rule->survive = masks[1];
+  return true;
+  }
+
+/*===========================================================================
+
+  Life3D::engine_from_name
+
+===========================================================================*/
+bool Life3D::engine_from_name (const char *name, Life3DEngine *engine)
+  {
+  if (strcmp (name, "dense") == 0)
+    {
+    *engine = LIFE3D_ENGINE_DENSE;
+    return true;
+    }
+  if (strcmp (name, "bits") == 0)
+    {
+    *engine = LIFE3D_ENGINE_BITS;
+    return true;
+    }
+  if (strcmp (name, "sparse") == 0)
+    {
+    *engine = LIFE3D_ENGINE_SPARSE;
+    return true;
+    }
+  if (strcmp (name, "auto") == 0)
+    {
+    *engine = LIFE3D_ENGINE_AUTO;
+    return true;
+    }
+  if (strcmp (name, "hashlife") == 0)
+    {
+    *engine = LIFE3D_ENGINE_HASHLIFE;
+    return true;
+    }
+  return false;
+  }
+
+/*===========================================================================
+
+  Life3D::counting_from_name
+
+===========================================================================*/
+bool Life3D::counting_from_name (const char *name, Life3DCounting *counting)
+  {
+  if (strcmp (name, "direct") == 0)
+    {
+    *counting = LIFE3D_COUNTING_DIRECT;
+    return true;
+    }
+  if (strcmp (name, "separable") == 0)
+    {
+    *counting = LIFE3D_COUNTING_SEPARABLE;
+    return true;
+    }
+  return false;
+  }
+
+/*===========================================================================
+
+  Life3D::boundary_from_name
+
+===========================================================================*/
+bool Life3D::boundary_from_name (const char *name, Life3DBoundary *boundary)
+  {
+  if (strcmp (name, "torus") == 0)
+    {
+    *boundary = LIFE3D_BOUNDARY_TORUS;
+    return true;
+    }
+  if (strcmp (name, "dead") == 0)
+    {
+    *boundary = LIFE3D_BOUNDARY_DEAD;
+    return true;
+    }
+  if (strcmp (name, "mirror") == 0)
+    {
+    *boundary = LIFE3D_BOUNDARY_MIRROR;
+    return true;
+    }
+  return false;
+  }
+
@@ -4,16 +4,146 @@
 
   Copyright (c)2020-1 Kevin Boone, GPL v3.0
 
-  A class for managing the lifecycles of cells in a cubic grid
+  A class for managing the lifecycles of cells in a rectangular grid
 
 ============================================================================*/
 #pragma once
 
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class ThreadPool;
+class HashLife3D;
+
+// The number of past generations whose hashes are kept, to find 
+//   repeating patterns. The longest period that can be detected is
+//   one less than this.
+#define LIFE3D_HISTORY 32
+
+/** The ways in which Life3D can compute a new generation. All engines
+    give the same public view of the grid (get_age(), etc); they differ
+    only in how the neighbour counts are worked out. */
+typedef enum
+  {
+  // One int per cell, with 26 separate loads to count neighbours
+  LIFE3D_ENGINE_DENSE = 0,
+  // Liveness packed 64 cells to a word along the z axis, with
+  //   neighbour counts worked out by bit-sliced addition
+  LIFE3D_ENGINE_BITS,
+  // Only the live cells, and the cells next to them, are visited,
+  //   so the cost depends on the population rather than the volume
+  LIFE3D_ENGINE_SPARSE,
+  // Dense or sparse, whichever suits the present population density
+  LIFE3D_ENGINE_AUTO,
+  // An octree with memoized futures, which can advance by many 
+  //   generations at once. The grid size must be a power of two.
+  LIFE3D_ENGINE_HASHLIFE
+  } Life3DEngine;
+
+/** What lies beyond the faces of the grid. */
+typedef enum
+  {
+  // The grid wraps round, so a cell on one face is next to the
+  //   cell opposite it on the far face
+  LIFE3D_BOUNDARY_TORUS = 0,
+  // Everything outside the grid is dead
+  LIFE3D_BOUNDARY_DEAD,
+  // Each face is a mirror, so a cell on a face sees itself reflected
+  //   just outside it
+  LIFE3D_BOUNDARY_MIRROR
+  } Life3DBoundary;
+
+/** How the dense engine counts each cell's neighbours. Both give
+    the same results. */
+typedef enum
+  {
+  // Look at each of the 26 neighbours in turn
+  LIFE3D_COUNTING_DIRECT = 0,
+  // Sum each run of three cells along z, then three of those sums
+  //   along y, then three of those along x, and subtract the cell
+  //   itself: six additions and a subtraction, rather than 26 additions
+  LIFE3D_COUNTING_SEPARABLE
+  } Life3DCounting;
+
+/** A birth/survival rule. Bit n of birth is set if a dead cell with
+    n live neighbours comes alive, and bit n of survive if a live cell
+    with n neighbours stays alive. n is 0-26. */
+typedef struct
+  {
+  uint32_t birth;
+  uint32_t survive;
+  } Life3DRule;
+
+/** The position of a cell in the grid */
+typedef struct
+  {
+  int x;
+  int y;
+  int z;
+  } Life3DCell;
+
+/** A copy of the ages of the cells of a Life3D grid at one generation,
+    made by Life3D::snapshot(), so that it can be drawn while the grid
+    moves on. Ages above 255 are kept as 255. */
+class Life3DFrame
+  {
+  public:
+
+  Life3DFrame (void) { size_x = size_y = size_z = 0; population = 0; }
+
+  int get_size_x (void) const { return size_x; }
+  int get_size_y (void) const { return size_y; }
+  int get_size_z (void) const { return size_z; }
+
+  /** The number of live cells */
+  size_t get_population (void) const { return population; }
+
+  int get_age (int x, int y, int z) const 
+    { return ages[((size_t)x * size_y + y) * size_z + z]; }
+
+  bool is_alive (int x, int y, int z) const 
+    { return get_age (x, y, z) > 0; }
+
+  /** Exchange contents with another frame. This does not copy the
+      cells, so frames can be passed from one owner to another 
+      without allocating any memory. */
+  void swap (Life3DFrame &other);
+
+  /** Find the cells that have changed since an earlier call. shown 
+      holds one byte for each cell, in x, then y, then z order: its age
+      at the time of that call, or max_age if it was older. Each cell 
+      whose age, limited in the same way, is now different is appended
+      to changed, and shown is brought up to date. So a cell that is
+      born, or dies, or ages, is reported, but one that only gets older
+      than max_age (at most 255) is not. If shown is not the size of 
+      the grid, it is made so, and every live cell is reported. */
+  void find_changes (std::vector<unsigned char> &shown, int max_age,
+    std::vector<Life3DCell> &changed) const;
+
+  protected:
+
+  friend class Life3D;
+
+  int size_x;
+  int size_y;
+  int size_z;
+  size_t population;
+  // One byte for each cell, in x, then y, then z order
+  std::vector<unsigned char> ages;
+  };
+
 class Life3D
   {
   public:
 
-  Life3D (int size, double filling);
+  /** Create a grid of size_x x size_y x size_z cells. The HashLife
+      engine works only with a toroidal boundary, and a cube whose side
+      is a power of two; otherwise the dense engine is used instead.
+      If there is not enough memory for the grid, the program stops. */
+  Life3D (int size_x, int size_y, int size_z, double filling,
+    Life3DEngine engine = LIFE3D_ENGINE_DENSE,
+    Life3DBoundary boundary = LIFE3D_BOUNDARY_TORUS);
   ~Life3D (void);
 
   /** Intialize the grid with cells of zero age (i.e., empty) or
@@ -26,10 +156,14 @@ class Life3D
   /** Returns the age of a cell. A zero return means there is no cell
       at the given location. */
   int get_age (int x, int y, int z) const;
-  
+
   /** Returns true if there are now no live cells in the grid. */
   bool is_empty (void) const;
 
+  /** Copy the ages of the cells into frame. Once the frame has been
+      used for a grid of this size, no memory is allocated. */
+  void snapshot (Life3DFrame &frame) const;
+
   /** Count the number of neighbours, that is, the number of live
       cells (age > 0) for a given location. */
   int neighbours (int x, int y, int z) const;
@@ -37,21 +171,221 @@ class Life3D
   /** Compute the new cell layout from the present one. */
   void step (void);
 
-  /* Return the dimension of the cell grid, as given in the
+  /** Advance by the given number of generations. With the HashLife 
+      engine this can be very much faster than calling step() that
+      many times, but the ages of the cells are only approximate: a 
+      cell that is alive before and after is taken to have lived 
+      throughout, and one that was not alive before is given age 1. */
+  void advance (long gens);
+
+  /* Return the dimensions of the cell grid, as given in the
      constructor. */
-  int get_size (void) const { return size; }
-  
+  int get_size_x (void) const { return size_x; }
+  int get_size_y (void) const { return size_y; }
+  int get_size_z (void) const { return size_z; }
+
+  /** Returns the total number of cells in the grid */
+  size_t get_volume (void) const { return volume; }
+
+  Life3DEngine get_engine (void) const { return engine; }
+
+  Life3DBoundary get_boundary (void) const { return boundary; }
+
+  /** Returns the number of live cells */
+  size_t get_population (void) const { return population; }
+
+  /** Returns a 64-bit hash of which cells are alive (but not their
+      ages). Two grids with the same hash almost certainly have the 
+      same live cells. The hash is kept up to date as cells change, 
+      so this costs nothing. */
+  uint64_t get_hash (void) const { return hash; }
+
+  /** If the live cells are the same as they were k steps ago, and 
+      were different at every step in between, return k; so 1 means
+      a still life, and 2 a pattern that flips between two states. 
+      Returns 0 if there is no such k less than LIFE3D_HISTORY, or if
+      too few steps have been taken since seed() to tell. With the 
+      HashLife engine, each call to advance() counts as one step. */
+  int get_period (void) const;
+
+  /** Share the work of step() out among the threads of a pool, each
+      taking a slab of consecutive x planes. The pool must outlive this
+      object, or be replaced by another call. NULL means single-threaded.
+      */
+  void set_thread_pool (ThreadPool *pool);
+
+  /** Set the memory that the HashLife engine may use for its cache of
+      nodes before it is thrown away and started afresh. */
+  void set_cache_limit (size_t bytes);
+
+  /** Set the rule that decides which cells are born and which survive.
+      The default is B45/S567. A rule in which cells are born with no
+      neighbours is not supported, and the birth on zero is ignored. */
+  void set_rule (const Life3DRule &rule);
+
+  const Life3DRule &get_rule (void) const { return rule; }
+
+  /** Parse a rule in the form "B45/S567": the letter B followed by the
+      neighbour counts for birth, and S by those for survival. Either
+      part may come first, and either may be empty. Each digit is a
+      separate count unless the list contains commas or ranges, as in
+      "B4,5,13/S5-7", in which case each item may have two digits.
+      Returns false if the rule is not valid, or if it has cells born
+      with no neighbours. */
+  static bool rule_from_string (const char *spec, Life3DRule *rule);
+
+  /** Set the way the dense engine counts neighbours. The default is
+      LIFE3D_COUNTING_SEPARABLE. */
+  void set_counting (Life3DCounting counting);
+
+  Life3DCounting get_counting (void) const { return counting; }
+
+  /** Look up a counting method by the name used on the command line 
+      ("direct", "separable"). Returns false if the name is not
+      recognized. */
+  static bool counting_from_name (const char *name, 
+      Life3DCounting *counting);
+
+  /** Look up an engine by the name used on the command line ("dense",
+      "bits", "sparse", "auto", "hashlife"). Returns false if the name 
+      is not recognized. */
+  static bool engine_from_name (const char *name, Life3DEngine *engine);
+
+  /** Look up a boundary by the name used on the command line ("torus",
+      "dead", "mirror"). Returns false if the name is not recognized. */
+  static bool boundary_from_name (const char *name, 
+      Life3DBoundary *boundary);
+
   protected:
 
-  void die (int x, int y, int z);
-  void spawn (int x, int y, int z);
-  int constrain (int n) const;
-  void increment_age (int x, int y, int z);
+  /** The position in cells of the cell at x, y, z, which may each be
+      from -1 to the size on that axis, to reach the halo */
+  size_t index (int x, int y, int z) const
+    { return (size_t)(x + 1) * stride_x + (size_t)(y + 1) * stride_y 
+        + z + 1; }
+
+  /** The coordinate, from 0 to extent-1, of the cell whose state
+      appears at coordinate n (-1 to extent) along an axis of the given
+      extent, given the boundary. Returns -1 if the position is outside
+      the grid and always dead. */
+  int edge_source (int n, int extent) const;
+
+  void fill_halo (void);
+  static void step_job (int worker, int workers, void *data);
+  template <class Rule> size_t step_dense_slab (int x0, int x1, 
+    unsigned char *scratch, uint64_t *changed);
+  template <class Rule> size_t step_separable_slab (int x0, int x1, 
+    unsigned char *scratch, uint64_t *changed);
+  void pick_kernels (void);
+  size_t count_population (void) const;
+  uint64_t count_hash (void) const;
+  void remember_hash (void);
+
+  /** The random number for the cell at position i of cells. The hash
+      of the grid is all the live cells' keys XORed together, so when
+      a cell is born or dies, the hash changes by its key. This is 
+      splitmix64, which turns consecutive numbers into well-scattered
+      ones. */
+  static uint64_t cell_key (size_t i)
+    {
+    uint64_t k = i * 0x9E3779B97F4A7C15ULL;
+    k = (k ^ (k >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    k = (k ^ (k >> 27)) * 0x94D049BB133111EBULL;
+    return k ^ (k >> 31);
+    }
+  bool use_sparse (void);
+  void advance_hashlife (long gens);
 
+  // Implementation of the bit-packed engine, in life3dbits.cpp
+  void pack_bits (void);
+  template <class Rule> size_t step_bits_slab (int x0, int x1, 
+    uint64_t *scratch, uint64_t *changed);
 
+  // Implementation of the sparse engine, in life3dsparse.cpp
+  void find_live (void);
+  void step_sparse (void);
+
+  // The current generation, which is what the public methods
+  //   report on, and the buffer the next generation is written into.
+  //   step() swaps them. Each is the grid with a one-cell halo round 
+  //   it, so is two cells larger on each axis. The halo holds copies 
+  //   of the cells that lie across each face, according to the
+  //   boundary. So a cell's neighbours are always at the same offsets
+  //   from it, wherever it is in the grid. fill_halo() must be called
+  //   whenever cells changes.
   int *cells;
-  int size;
-  int size_squared; // Precompute this for speed
+  int *next_cells;
+  int size_x;
+  int size_y;
+  int size_z;
+  size_t volume;    // size_x * size_y * size_z
+  size_t stride_y;  // Distance between cells adjacent in y (size_z + 2)
+  size_t stride_x;  // Distance between cells adjacent in x
+  long neighbour_offset[26];
   double filling;
+  Life3DEngine engine;
+  Life3DBoundary boundary;
+  ThreadPool *pool;
+  size_t population;
+  size_t *slab_population; // Live cells counted by each worker in step()
+
+  // The hash of the live cells, and the XOR of the keys of the cells
+  //   each worker saw change in step(). history is a ring of the
+  //   hashes of the last history_len generations, the latest at 
+  //   history_pos.
+  uint64_t hash;
+  uint64_t *slab_hash;
+  uint64_t history[LIFE3D_HISTORY];
+  int history_len;
+  int history_pos;
+
+  // The rule, and the same rule as a transition table: entry n
+  //   has LIFE3D_BORN set if a dead cell with n neighbours comes alive,
+  //   and LIFE3D_SURVIVES if a live one stays alive. The kernels are
+  //   the versions of step_dense_slab() (or step_separable_slab()) and
+  //   step_bits_slab() that suit the rule -- see life3drule.h.
+  Life3DRule rule;
+  unsigned char transition[27];
+  Life3DCounting counting;
+  size_t (Life3D::*dense_kernel) (int x0, int x1, unsigned char *scratch,
+    uint64_t *changed);
+  size_t (Life3D::*bits_kernel) (int x0, int x1, uint64_t *scratch,
+    uint64_t *changed);
+
+  // Used only by separable counting in the dense engine: room for the 
+  //   partial sums, one area per worker thread
+  unsigned char *count_scratch;
+  size_t count_scratch_bytes;
+
+  // Used only by the bit-packed engine. Each (x,y) row of cells
+  //   along z occupies words_per_row consecutive words; cells is then
+  //   just a side array of ages, touched only for live cells.
+  uint64_t *bits;
+  uint64_t *next_bits;
+  uint64_t *bit_scratch; // One area per worker thread
+  size_t bit_scratch_words;
+  int words_per_row;
+
+  // Used only by the sparse engine, which updates cells in place
+  //   once it has worked out every change. live lists the indexes of
+  //   the live cells, and is valid only while live_valid is true.
+  //   A cell's stamp is set to stamp_gen when it is added to the
+  //   candidates for the present step, so it is only added once.
+  struct Change
+    {
+    size_t index;
+    int age;
+    };
+  std::vector<size_t> live;
+  std::vector<size_t> next_live;
+  std::vector<size_t> candidates;
+  std::vector<Change> changes;
+  unsigned *stamp;
+  unsigned stamp_gen;
+  bool live_valid;
+
+  // Used only by the HashLife engine, and created when first needed
+  HashLife3D *hashlife;
+  size_t cache_limit;
   };
 
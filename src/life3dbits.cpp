@@ -0,0 +1,328 @@
+/*============================================================================
+
+  life3dbits.cpp
+
+  Copyright (c)2020-1 Kevin Boone, GPL v3.0
+
+  The bit-packed engine for Life3D. Liveness is held one bit per cell,
+  64 cells to a word along the z axis, and the neighbour counts for
+  a whole word of cells are worked out together, using bitwise adders
+  on "bit-sliced" numbers. That is, a count of 0-27 is held as five
+  words, the first holding bit 0 of the count for each of 64 cells,
+  the second holding bit 1, and so on.
+
+  The count is built up in three separable passes: the sum of each
+  cell and its two z neighbours (0-3, two slices), then the sum of three
+  of those along y (0-9, four slices), then the sum of three of those
+  along x (0-27, five slices). Note that the last sum includes the
+  cell itself, which the rule evaluation allows for.
+
+  What lies beyond the edges depends on the boundary, and is worked
+  out as the sums are formed; the bits have no halo.
+
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "life3d.h"
+#include "life3drule.h"
+
+/*===========================================================================
+
+  row_sum_z
+
+  For one row of words_per_row words, work out the two-slice sum
+  of each cell and its neighbours either side in z. The cells beyond
+  the ends of the row depend on the boundary.
+
+===========================================================================*/
+static void row_sum_z (const uint64_t *row, int words_per_row,
+    int last_bits, Life3DBoundary boundary, uint64_t *s0, uint64_t *s1)
+  {
+  int last = words_per_row - 1;
+  uint64_t last_mask = last_bits == 64 ? ~0ULL : (1ULL << last_bits) - 1;
+
+  // The cells at z = -1 and z = size_z
+  uint64_t first_cell = row[0] & 1;
+  uint64_t last_cell = (row[last] >> (last_bits - 1)) & 1;
+  uint64_t below = 0, above = 0;
+  if (boundary == LIFE3D_BOUNDARY_TORUS)
+    {
+    below = last_cell;
+    above = first_cell;
+    }
+  else if (boundary == LIFE3D_BOUNDARY_MIRROR)
+    {
+    below = first_cell;
+    above = last_cell;
+    }
+
+  for (int w = 0; w < words_per_row; w++)
+    {
+    uint64_t c = row[w];
+    uint64_t hi = w < last ? row[w + 1] : 0;
+    uint64_t lo = w > 0 ? row[w - 1] : 0;
+
+    // up -- each bit is the cell at z+1; down -- the cell at z-1
+    uint64_t up = (c >> 1) | (hi << 63);
+    uint64_t down = (c << 1) | (lo >> 63);
+    if (w == last)
+      {
+      up |= above << (last_bits - 1);
+      down &= last_mask;
+      }
+    if (w == 0)
+      down |= below;
+
+    // Full adder
+    uint64_t t = c ^ up;
+    s0[w] = t ^ down;
+    s1[w] = (c & up) | (t & down);
+    }
+  }
+
+/*===========================================================================
+
+  add3_2
+
+  Add three bit-sliced numbers of two slices each (0-3), giving four
+  slices (0-9).
+
+===========================================================================*/
+static inline void add3_2 (uint64_t a0, uint64_t a1, uint64_t b0,
+    uint64_t b1, uint64_t c0, uint64_t c1, uint64_t *r)
+  {
+  // Bit 0: full adder across the three low slices
+  uint64_t t = a0 ^ b0;
+  uint64_t k0 = (a0 & b0) | (t & c0);
+  r[0] = t ^ c0;
+  // Bit 1: three high slices plus the carry from bit 0
+  uint64_t u = a1 ^ b1;
+  uint64_t m = u ^ c1;
+  uint64_t k1 = (a1 & b1) | (u & c1);
+  r[1] = m ^ k0;
+  uint64_t k2 = m & k0;
+  // Bit 2 and 3: the two carries out of bit 1
+  r[2] = k1 ^ k2;
+  r[3] = k1 & k2;
+  }
+
+/*===========================================================================
+
+  add3_4
+
+  Add three bit-sliced numbers of four slices each (0-9), giving five
+  slices (0-27).
+
+===========================================================================*/
+static inline void add3_4 (const uint64_t *a, const uint64_t *b,
+    const uint64_t *c, uint64_t *r)
+  {
+  // Carry-save: reduce a + b + c to sum + 2 * carry, then do one
+  //   ripple-carry addition
+  uint64_t s[4], k[4];
+  for (int i = 0; i < 4; i++)
+    {
+    uint64_t t = a[i] ^ b[i];
+    s[i] = t ^ c[i];
+    k[i] = (a[i] & b[i]) | (t & c[i]);
+    }
+  r[0] = s[0];
+  uint64_t carry = 0;
+  for (int i = 1; i < 5; i++)
+    {
+    uint64_t x = i < 4 ? s[i] : 0;
+    uint64_t y = k[i - 1];
+    uint64_t t = x ^ y;
+    r[i] = t ^ carry;
+    carry = (x & y) | (t & carry);
+    }
+  }
+
+/*===========================================================================
+
+  apply_rule
+
+  Given the five-slice total (cell plus neighbours) and the cell's
+  present liveness, return the liveness in the next generation.
+  With a FixedRule, the tests on b and s are constants, and the loop
+  reduces to the few totals that the rule cares about.
+
+===========================================================================*/
+template <class Rule>
+static inline uint64_t apply_rule (const Rule &test, const uint64_t *t, 
+    uint64_t alive)
+  {
+  uint64_t born = 0, survive = 0;
+  for (int v = 0; v <= 27; v++)
+    {
+    // A live cell is counted in its own total, so it has v - 1
+    //   neighbours; a dead cell has v
+    bool b = v < 27 && test.born (v);
+    bool s = v > 0 && test.survives (v - 1);
+    if (!b && !s) continue;
+    uint64_t eq = ~0ULL;
+    for (int i = 0; i < 5; i++)
+      eq &= (v & (1 << i)) ? t[i] : ~t[i];
+    if (b) born |= eq;
+    if (s) survive |= eq;
+    }
+  return (born & ~alive) | (survive & alive);
+  }
+
+/*===========================================================================
+
+  Life3D::pack_bits
+
+  Set the liveness bits from the ages in the cells array
+
+===========================================================================*/
+void Life3D::pack_bits (void)
+  {
+  memset (bits, 0, 
+    (size_t)size_x * size_y * words_per_row * sizeof (uint64_t));
+  for (int x = 0; x < size_x; x++)
+    {
+    for (int y = 0; y < size_y; y++)
+      {
+      uint64_t *row = bits + ((size_t)x * size_y + y) * words_per_row;
+      const int *ages = cells + index (x, y, 0);
+      for (int z = 0; z < size_z; z++)
+        {
+        if (ages[z]) row[z >> 6] |= 1ULL << (z & 63);
+        }
+      }
+    }
+  }
+
+/*===========================================================================
+
+  Life3D::step_bits_slab
+
+  Work out the new generation for planes x0 to x1-1, writing it
+  to next_bits. The caller swaps bits and next_bits when all slabs are
+  done. scratch must have room for BIT_SCRATCH_PLANES planes.
+  Returns the number of cells alive in the slab in the new generation,
+  and sets changed to the XOR of the keys of the cells that were born
+  or died.
+
+===========================================================================*/
+template <class Rule> size_t Life3D::step_bits_slab (int x0, int x1, 
+    uint64_t *scratch, uint64_t *changed)
+  {
+  Rule test (transition);
+  size_t alive = 0;
+  uint64_t h = 0;
+  int wpr = words_per_row;
+  int last_bits = size_z - (wpr - 1) * 64;
+  size_t plane_words = (size_t)size_y * wpr;
+
+  // Scratch: two slices of z sums for one plane, a ring of three
+  //   planes of four-slice yz sums, for x-1, x, and x+1, and a plane
+  //   whose first row is zeros, to stand in for the two slices of a 
+  //   dead row beyond the y faces
+  uint64_t *zsum = scratch;
+  uint64_t *yzsum = scratch + 2 * plane_words;
+  uint64_t *zero = scratch + 14 * plane_words;
+  memset (zero, 0, wpr * sizeof (uint64_t));
+
+  // The yz sums for plane x0 - 1 + i go into ring slot i % 3
+  #define YZSUM(i) (yzsum + ((i) % 3) * 4 * plane_words)
+  for (int i = 0; i < x1 - x0 + 2; i++)
+    {
+    int px = edge_source (x0 - 1 + i, size_x);
+    uint64_t *ys = YZSUM(i);
+    if (px < 0)
+      memset (ys, 0, 4 * plane_words * sizeof (uint64_t));
+    else
+      {
+      const uint64_t *plane = bits + px * plane_words;
+      for (int y = 0; y < size_y; y++)
+        row_sum_z (plane + (size_t)y * wpr, wpr, last_bits, boundary, 
+          zsum + (size_t)y * wpr, zsum + plane_words + (size_t)y * wpr);
+      for (int y = 0; y < size_y; y++)
+        {
+        int ya = edge_source (y - 1, size_y);
+        int yc = edge_source (y + 1, size_y);
+        const uint64_t *a0 = ya < 0 ? zero : zsum + (size_t)ya * wpr;
+        const uint64_t *a1 = ya < 0 ? zero 
+          : zsum + plane_words + (size_t)ya * wpr;
+        const uint64_t *c0 = yc < 0 ? zero : zsum + (size_t)yc * wpr;
+        const uint64_t *c1 = yc < 0 ? zero 
+          : zsum + plane_words + (size_t)yc * wpr;
+        size_t yb = (size_t)y * wpr;
+        for (int w = 0; w < wpr; w++)
+          {
+          uint64_t r[4];
+          add3_2 (a0[w], a1[w], zsum[yb + w], zsum[plane_words + yb + w],
+                  c0[w], c1[w], r);
+          for (int k = 0; k < 4; k++)
+            ys[k * plane_words + yb + w] = r[k];
+          }
+        }
+      }
+
+    // Once we have three consecutive planes, we can finish the
+    //   middle one
+    if (i < 2) continue;
+    int tx = x0 + i - 2;
+    const uint64_t *ya = YZSUM(i - 2);
+    const uint64_t *yb = YZSUM(i - 1);
+    const uint64_t *yc = YZSUM(i);
+    for (int y = 0; y < size_y; y++)
+      {
+      size_t row = (size_t)tx * size_y + y;
+      const uint64_t *old_row = bits + row * wpr;
+      uint64_t *new_row = next_bits + row * wpr;
+      size_t first = index (tx, y, 0);
+      int *ages = cells + first;
+      for (int w = 0; w < wpr; w++)
+        {
+        size_t o = (size_t)y * wpr + w;
+        uint64_t a[4], b[4], c[4], t[5];
+        for (int k = 0; k < 4; k++)
+          {
+          a[k] = ya[k * plane_words + o];
+          b[k] = yb[k * plane_words + o];
+          c[k] = yc[k * plane_words + o];
+          }
+        add3_4 (a, b, c, t);
+        uint64_t old = old_row[w];
+        uint64_t nw = apply_rule (test, t, old);
+        if (w == wpr - 1 && last_bits < 64) nw &= (1ULL << last_bits) - 1;
+        new_row[w] = nw;
+        alive += __builtin_popcountll (nw);
+
+        // Ages are only touched for cells that are alive in one
+        //   generation or the other, and only the cells born or
+        //   died change the hash
+        int *wages = ages + w * 64;
+        size_t wfirst = first + w * 64;
+        uint64_t m = old & nw;
+        while (m) { wages[__builtin_ctzll (m)]++; m &= m - 1; }
+        m = old ^ nw;
+        while (m) 
+          { 
+          int b = __builtin_ctzll (m);
+          wages[b] = (nw >> b) & 1; 
+          h ^= cell_key (wfirst + b);
+          m &= m - 1; 
+          }
+        }
+      }
+    }
+  #undef YZSUM
+  *changed = h;
+  return alive;
+  }
+
+// Life3D::set_rule() picks one of these
+template size_t Life3D::step_bits_slab<TableRule> (int, int, uint64_t *,
+  uint64_t *);
+#define LIFE3D_INSTANTIATE_RULE(name, b, s) \
+  template size_t Life3D::step_bits_slab<name> (int, int, uint64_t *, \
+    uint64_t *);
+LIFE3D_FIXED_RULES (LIFE3D_INSTANTIATE_RULE)
+#undef LIFE3D_INSTANTIATE_RULE
+
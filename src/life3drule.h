@@ -0,0 +1,62 @@
+/*============================================================================
+
+  life3drule.h
+
+  Copyright (c)2020-1 Kevin Boone, GPL v3.0
+
+  The rule evaluators used inside the Life3D engines' step kernels.
+  Each kernel is a template on one of these, so that for the common
+  rules, whose masks are compile-time constants, the compiler can
+  fold the rule test into a few instructions, with no lookup at all.
+  Any other rule uses TableRule, which looks up the transition table
+  that Life3D::set_rule() builds.
+
+  This header is for the engines' use only; the rest of the program
+  need only know about Life3DRule, in life3d.h.
+
+============================================================================*/
+#pragma once
+
+#include <stdint.h>
+
+// Bits in each entry of Life3D's transition table
+#define LIFE3D_BORN 1
+#define LIFE3D_SURVIVES 2
+
+// Bit n of a birth or survival mask is set if the rule applies
+//   to a cell with n neighbours
+#define LIFE3D_MASK2(a, b) ((1U << (a)) | (1U << (b)))
+#define LIFE3D_MASK3(a, b, c) (LIFE3D_MASK2 (a, b) | (1U << (c)))
+
+/** A rule whose masks are fixed when the kernel is compiled */
+template <uint32_t BIRTH, uint32_t SURVIVE>
+struct FixedRule
+  {
+  FixedRule (const unsigned char *table) { (void)table; }
+  bool born (int n) const { return (BIRTH >> n) & 1; }
+  bool survives (int n) const { return (SURVIVE >> n) & 1; }
+  };
+
+/** A rule that is looked up in the transition table */
+struct TableRule
+  {
+  const unsigned char *table;
+  TableRule (const unsigned char *table) { this->table = table; }
+  bool born (int n) const { return table[n] & LIFE3D_BORN; }
+  bool survives (int n) const { return table[n] & LIFE3D_SURVIVES; }
+  };
+
+/** The rules that get their own compiled kernels, as
+    X(name, birth mask, survival mask). The first is the default.
+    Each kernel adds to the size of the program, so only add rules
+    here that are actually used a lot. */
+#define LIFE3D_FIXED_RULES(X) \
+  X (RuleB45S567, LIFE3D_MASK2 (4, 5), LIFE3D_MASK3 (5, 6, 7)) \
+  X (RuleB5S45, 1U << 5, LIFE3D_MASK2 (4, 5)) \
+  X (RuleB6S567, 1U << 6, LIFE3D_MASK3 (5, 6, 7))
+
+#define LIFE3D_DECLARE_RULE(name, b, s) \
+  typedef FixedRule<(b), (s)> name;
+LIFE3D_FIXED_RULES (LIFE3D_DECLARE_RULE)
+#undef LIFE3D_DECLARE_RULE
+
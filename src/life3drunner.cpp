@@ -8,113 +8,333 @@
 ==========================================================================*/
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
 #include "life3drunner.h"
 #include "life3d.h"
 #include "log.h"
 #include "imager.h"
+#include "spherelattice.h"
 
 /*==========================================================================
  
   Life3DRunner constructor 
 
 ==========================================================================*/
-Life3DRunner::Life3DRunner (FrameBuffer *fb, int size, 
-    int pixels, double zoom, int q, int gens, int delay,
-    double filling)
+Life3DRunner::Life3DRunner (FrameBuffer *fb, int size_x, int size_y,
+    int size_z, int pixels, double zoom, int q, int gens, double delay,
+    double filling, Life3DEngine engine, int threads, int leap,
+    size_t cache_limit, const Life3DRule &rule, Life3DBoundary boundary,
+    Life3DCounting counting, Life3DCycleAction cycle,
+    Life3DRenderer renderer, bool adaptive, const char *stats_file)
   {
   this->fb = fb;
-  this->size = size;
+  this->size_x = size_x;
+  this->size_y = size_y;
+  this->size_z = size_z;
   this->pixels = pixels;
   this->zoom = zoom;
   this->q = q;
   this->gens = gens;
   this->delay = delay;
   this->filling = filling;
+  this->engine = engine;
+  this->leap = leap;
+  this->cache_limit = cache_limit;
+  this->rule = rule;
+  this->boundary = boundary;
+  this->counting = counting;
+  this->cycle = cycle;
+  this->renderer = renderer;
+  this->adaptive = adaptive;
+  this->stats_file = stats_file ? strdup (stats_file) : NULL;
+  memset (stage_ms, 0, sizeof (stage_ms));
+  pool = new ThreadPool (threads);
+  int sim_threads = pool->get_threads() / LIFE3D_SIMULATION_SHARE;
+  sim_pool = new ThreadPool (sim_threads > 0 ? sim_threads : 1);
+  incremental = new Imager::IncrementalImage();
+  scene = NULL;
+  life3D = NULL;
+  }
+
+/*==========================================================================
+ 
+  Life3DRunner destructor 
+
+==========================================================================*/
+Life3DRunner::~Life3DRunner (void)
+  {
+  // The scene may refer to the incremental image, and uses the pool
+  delete scene;
+  delete incremental;
+  delete pool;
+  delete sim_pool;
+  free (stats_file);
   }
 
 
 /*==========================================================================
  
-  render
+  age_colour
+
+  New cells are red, becoming more blue as they age
+
+==========================================================================*/
+static Imager::Color age_colour (int age)
+  {
+  using namespace Imager;
+  switch (age)
+    {
+    case 1: return Color (1, 0, 0);
+    case 2: return Color (0.8, 0, 0.2);
+    case 3: return Color (0.6, 0, 0.4);
+    case 4: return Color (0.4, 0, 0.6);
+    case 5: return Color (0.2, 0, 0.8);
+    default: return Color (0, 0, 1);
+    }
+  }
+
+/*==========================================================================
+ 
+  timespec_add
+
+  Move a time on by a number of seconds
+
+==========================================================================*/
+static void timespec_add (struct timespec *t, double seconds)
+  {
+  time_t whole = (time_t)seconds;
+  t->tv_sec += whole;
+  t->tv_nsec += (long)((seconds - whole) * 1e9);
+  if (t->tv_nsec >= 1000000000L)
+    {
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000L;
+    }
+  }
+
+/*==========================================================================
+ 
+  timespec_diff
+
+  The number of seconds from b to a; negative if a is earlier
+
+==========================================================================*/
+static double timespec_diff (const struct timespec *a, 
+    const struct timespec *b)
+  {
+  return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+  }
+
+/*==========================================================================
+ 
+  ms_since
+
+  The number of milliseconds from start until now
+
+==========================================================================*/
+static double ms_since (const struct timespec *start)
+  {
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return timespec_diff (&now, start) * 1e3;
+  }
 
-  Use Don Cross's ray tracer to render the cubic grid of cells into
+/*==========================================================================
+ 
+  stats_signal
+
+  SIGUSR1 asks for the frame times to be written out; run() does so 
+  after the frame it is drawing, since the handler itself can't 
+  safely do much.
+
+==========================================================================*/
+static volatile sig_atomic_t stats_wanted = 0;
+
+static void stats_signal (int dummy)
+  {
+  stats_wanted = 1;
+  }
+
+/*==========================================================================
+ 
+  build_scene
+
+  Use Don Cross's ray tracer to render the grid of cells into
   a collection of spheres. There's plenty of scope of tweaking here, 
   but it isn't entirely obvious how to link the various tunable
   parameters together in any kind of automated way. 
 
+  The grid is centred in x and y, and set back in z far enough for
+  its larger face dimension to fit the image; so a thin slab that
+  faces the viewer fills the picture, and a deep one recedes.
+
+  The scene is made once, and kept for as long as the game runs. 
+  With the spheres renderer, it holds a sphere for every cell, alive
+  or not, and render() only shows, hides, and colours them; so no 
+  memory is allocated or freed from one frame to the next. 
+
 ==========================================================================*/
-void Life3DRunner::render (FrameBuffer *fb, const Life3D &life3D)
+void Life3DRunner::build_scene (const Life3DFrame &frame)
   {
   LOG_IN
 
   using namespace Imager;
-  int N = life3D.get_size();
+  int NX = frame.get_size_x();
+  int NY = frame.get_size_y();
+  int NZ = frame.get_size_z();
+
+  delete scene;
+  spheres.clear();
 
   // Draw on a black (0, 0, 0) background
-  Scene scene (Color (0, 0, 0, 7.0e-2));
+  scene = new Scene (Color (0, 0, 0, 7.0e-2));
+
+  // Sphere radius in scene units. 
+  radius = 5;
+  // The sphere layout in the grid is determined
+  //   entirely by the radius and the number
+  //   of cells
+  spacing = 2.1 * radius;
+  double half_space = spacing / 2;
+  double box_x = (NX + 1) * spacing;
+  double box_y = (NY + 1) * spacing;
+  double box = box_x > box_y ? box_x : box_y;
+  // The centre of the sphere for cell (0, 0, 0)
+  origin = Vector (-box_x / 2 + half_space, -box_y / 2 + spacing, -box);
 
-  for (int x = 0; x < N; x++)
+  if (renderer == LIFE3D_RENDERER_LATTICE)
     {
-    for (int y = 0; y < N; y++)
+    SphereLattice *lattice = new SphereLattice (frame, origin, spacing, 
+      radius);
+    for (int age = 1; age <= 6; age++)
       {
-      for (int z = 0; z < N; z++)
+      Optics optics;
+      optics.SetMatteGlossBalance (0.0, age_colour (age), Color (0, 0, 0));
+      lattice->SetAgeOptics (age, optics);
+      }
+    scene->AddSolidObject (lattice);
+    }
+  else
+    {
+    // One sphere for each cell, in the same order as find_changes()
+    //   reports them. All are hidden until their cells come alive.
+    spheres.reserve ((size_t)NX * NY * NZ);
+    for (int x = 0; x < NX; x++)
+      {
+      for (int y = 0; y < NY; y++)
         {
-	int age = life3D.get_age (x, y, z);
-        if (age > 0) // Cell is alive
-	  {
-	  // Sphere radius in scene units. 
-	  double r = 5;
-	  // The sphere layout in the grid is determined
-	  //   entirely by the radius and the number
-	  //   of cells
-	  double spacing = 2.1 * r;
-	  double half_space = spacing / 2;
-	  double box = (N + 1) * spacing;
-          Sphere* sphere = new Sphere 
-	    (Vector (spacing * x - box / 2 + half_space, 
-	      spacing * y - box / 2 + spacing, 
-	      - spacing * z - box), 
-	      r);
-	  switch (age)
-	    {
-	    // Apply colour to the spheres, according to their age
-	    // New cells are red, becoming more blue as they age
-	    case 1:
-              sphere->SetFullMatte (Color (1, 0, 0));
-	      break;
-	    case 2:
-              sphere->SetFullMatte (Color (0.8, 0, 0.2));
-	      break;
-	    case 3:
-              sphere->SetFullMatte (Color (0.6, 0, 0.4));
-	      break;
-	    case 4:
-              sphere->SetFullMatte (Color (0.4, 0, 0.6));
-	      break;
-	    case 5:
-              sphere->SetFullMatte (Color (0.2, 0, 0.8));
-	      break;
-	    default:
-              sphere->SetFullMatte (Color (0, 0, 1));
-	    }
-          scene.AddSolidObject (sphere);
-	  }
+        for (int z = 0; z < NZ; z++)
+          {
+          Sphere* sphere = new Sphere (cell_centre (x, y, z), radius);
+          sphere->SetVisible (false);
+          scene->AddSolidObject (sphere);
+          spheres.push_back (sphere);
+          }
         }
       }
-
-    LOG_OUT
     }
 
   // It's interesting to fiddle with the location of the light sources
   // This first one is a long way to the left, and produces hard shadows...
-  scene.AddLightSource (LightSource (Vector (50, 0, 50), Color (0.9, 0.9, 0.9)));
+  scene->AddLightSource (LightSource (Vector (50, 0, 50), 
+    Color (0.9, 0.9, 0.9)));
   // This one is front and right, so fills in some of the dark areas
-  scene.AddLightSource (LightSource (Vector (-2, 0, 5), Color (0.5, 0.5, 0.5)));
+  scene->AddLightSource (LightSource (Vector (-2, 0, 5), 
+    Color (0.5, 0.5, 0.5)));
+
+  scene->SetThreadPool (pool);
+  scene->SetAdaptiveAntiAliasing (adaptive);
+  scene->SetIncrementalImage (incremental);
+  // Nothing has been drawn yet
+  incremental->Reset();
+  shown_ages.clear();
+
+  LOG_OUT
+  }
+
+/*==========================================================================
+ 
+  render
+
+  Bring the scene up to date with the grid, and draw it.
+
+==========================================================================*/
+void Life3DRunner::render (FrameBuffer *fb, const Life3DFrame &frame)
+  {
+  LOG_IN
+
+  using namespace Imager;
+
+  struct timespec start;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  // Find the places where a sphere has appeared, vanished, or changed
+  //   colour since the last frame. Ages beyond 6 all have the same 
+  //   colour. Only the tiles of the picture that can show the 
+  //   difference, directly or in a shadow, are traced again.
+  changed.clear ();
+  frame.find_changes (shown_ages, 6, changed);
+  int NY = frame.get_size_y();
+  int NZ = frame.get_size_z();
+  for (size_t i = 0; i < changed.size(); i++)
+    {
+    const Life3DCell &cell = changed[i];
+    if (renderer == LIFE3D_RENDERER_SPHERES)
+      {
+      Sphere *sphere = spheres[((size_t)cell.x * NY + cell.y) * NZ + cell.z];
+      int age = frame.get_age (cell.x, cell.y, cell.z);
+      sphere->SetVisible (age > 0);
+      if (age > 0)
+        sphere->SetFullMatte (age_colour (age));
+      }
+    Vector centre = cell_centre (cell.x, cell.y, cell.z);
+    Vector extent (radius, radius, radius);
+    incremental->Invalidate (BoundingBox (centre - extent, centre + extent));
+    }
+
+  stage_ms[FRAME_STAGE_SCENE] = ms_since (&start);
 
   // Draw the image to the framebuffer
-  scene.SaveImage (fb, pixels, pixels, zoom, q);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  scene->SaveImage (fb, pixels, pixels, zoom, q);
+  // The BVH is only built again when spheres have been shown or hidden,
+  //   which, with the spheres renderer, is nearly every generation
+  log_debug ("Rendered in %.1f ms, including %.2f ms to build the BVH",
+    ms_since (&start), scene->GetBvhBuildMilliseconds());
+  const Scene::RenderTimes &times = scene->GetRenderTimes();
+  stage_ms[FRAME_STAGE_BVH] = times.bvhBuild;
+  stage_ms[FRAME_STAGE_TRACE] = times.trace;
+  stage_ms[FRAME_STAGE_HEAL] = times.heal;
+  stage_ms[FRAME_STAGE_MAX_COLOUR] = times.maxColor;
+  stage_ms[FRAME_STAGE_DOWNSAMPLE] = times.downsample;
+  stage_ms[FRAME_STAGE_BLIT] = times.blit;
+  // Pixels whose rays met a tie, and were made up from their neighbours
+  log_debug ("%zu ambiguous pixels", scene->GetAmbiguousPixelCount());
+  log_debug ("%zu pixels anti-aliased", scene->GetRefinedPixelCount());
+  log_debug ("Traced %zu of %zu tiles, for %zu changed cells", 
+    scene->GetTracedTileCount(), scene->GetTileCount(), changed.size());
+#if RAYTRACE_COUNTERS
+  // What the ray tracer did, to show whether the lattice or the BVH
+  //   is keeping the number of tests per ray down
+  const RayCounters &rays = scene->GetRayCounters();
+  unsigned long all_rays = rays.primaryRays + rays.shadowRays
+    + rays.reflectionRays + rays.refractionRays;
+  log_debug ("Rays: %lu primary, %lu shadow, %lu reflected, %lu refracted",
+    rays.primaryRays, rays.shadowRays, rays.reflectionRays,
+    rays.refractionRays);
+  log_debug ("%.2f rays per pixel, %.2f solid and %.2f sphere tests "
+    "per ray, %lu sphere hits, %lu ambiguities",
+    (double)all_rays / ((double)pixels * pixels),
+    all_rays ? (double)rays.solidTests / all_rays : 0.0,
+    all_rays ? (double)rays.sphereTests / all_rays : 0.0,
+    rays.sphereHits, rays.ambiguities);
+#endif
+
+  LOG_OUT
   }
 
 
@@ -126,27 +346,279 @@ void Life3DRunner::render (FrameBuffer *fb, const Life3D &life3D)
 void Life3DRunner::run (void)
   {
   framebuffer_clear (fb);
-  Life3D life3D (size, filling);
+  Life3D life3D (size_x, size_y, size_z, filling, engine, boundary);
+  life3D.set_thread_pool (sim_pool);
+  life3D.set_cache_limit (cache_limit);
+  life3D.set_rule (rule);
+  life3D.set_counting (counting);
   srand (time (0));
-  life3D.seed();
+
+  // One line for each frame, after a line naming the stages
+  FILE *stats_out = NULL;
+  if (stats_file)
+    {
+    stats_out = fopen (stats_file, "w");
+    if (stats_out)
+      FrameStats::write_heading (stats_out);
+    else
+      log_warning ("Can't write %s: %s", stats_file, strerror (errno));
+    }
+  signal (SIGUSR1, stats_signal);
+
+  // From here on, only the simulation thread touches the grid; this
+  //   thread draws the frames it sends
+  this->life3D = &life3D;
+  pthread_create (&simulator, NULL, simulate_main, this);
+
+  // Each frame is due delay seconds after the last was due, however
+  //   long drawing took, so the pictures come at a steady rate. A 
+  //   frame that is not ready in time is drawn as soon as it is, and
+  //   the ones after are due from then on, rather than being hurried
+  //   to catch up. Late frames are counted in the stats, and a 
+  //   warning is given for them now and again.
+  struct timespec due, warned;
+  long frames = 0;
+  long late = 0;
+  long late_unwarned = 0;
+  double worst_unwarned = 0;
+  clock_gettime (CLOCK_MONOTONIC, &warned);
+  while (true)
+    {
+    Life3DRunnerFrame *next = queue.wait_front();
+    double late_ms = 0;
+    if (frames == 0)
+      clock_gettime (CLOCK_MONOTONIC, &due);
+    if (next->hold > 0)
+      timespec_add (&due, next->hold);
+    if (delay > 0 || next->hold > 0)
+      {
+      struct timespec now;
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      double lateness = timespec_diff (&now, &due);
+      if (lateness > 0 && frames > 0)
+        {
+        late_ms = lateness * 1e3;
+        late++;
+        late_unwarned++;
+        if (late_ms > worst_unwarned) worst_unwarned = late_ms;
+        log_debug ("Frame %ld is %.1f ms late (%ld of %ld frames late)", 
+          frames, late_ms, late, frames + 1);
+        if (late == 1 || 
+            timespec_diff (&now, &warned) >= LIFE3D_LATE_WARNING_SECONDS)
+          {
+          log_warning ("%ld frame(s) missed their deadlines, by up to "
+            "%.1f ms (%ld of %ld frames so far)", late_unwarned, 
+            worst_unwarned, late, frames + 1);
+          warned = now;
+          late_unwarned = 0;
+          worst_unwarned = 0;
+          }
+        due = now;
+        }
+      else
+        {
+        while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &due, 
+            NULL) == EINTR);
+        }
+      }
+    log_debug ("Step %d\n", next->steps);
+    // Take the frame, and give the slot back with the last frame's
+    //   storage in it, for the simulation to fill
+    shown.swap (next->frame);
+    memcpy (stage_ms, next->times, sizeof (stage_ms));
+    queue.pop();
+    if (scene == NULL)
+      build_scene (shown);
+    render (fb, shown); 
+
+    stats.add (stage_ms, late_ms);
+    if (stats_out)
+      FrameStats::write_line (stats_out, frames, stage_ms, late_ms);
+    if (stats_wanted)
+      {
+      stats_wanted = 0;
+      stats.dump (stderr);
+      }
+
+    if (delay > 0)
+      timespec_add (&due, delay);
+    else
+      clock_gettime (CLOCK_MONOTONIC, &due);
+    frames++;
+    }
+  }
+
+/*==========================================================================
+ 
+  simulate_main
+
+  The simulation thread. It keeps the queue full of frames, so that
+  the next is always ready as soon as the last has been drawn; when
+  the queue is full, it waits for a free slot.
+
+==========================================================================*/
+void *Life3DRunner::simulate_main (void *arg)
+  {
+  Life3DRunner *self = (Life3DRunner *)arg;
+  self->simulate (*self->life3D);
+  return NULL;
+  }
+
+/*==========================================================================
+ 
+  simulate
+
+==========================================================================*/
+void Life3DRunner::simulate (Life3D &life3D)
+  {
   int steps = 0;
+  double hold = 0;
+  // How long each stage took, for the frame that will be sent next
+  double times[FRAME_STAGE_COUNT] = { 0 };
+  struct timespec start;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  life3D.seed();
+  times[FRAME_STAGE_SEED] = ms_since (&start);
   while (true)
     {
-    log_debug ("Step %d\n", steps);
-    render (fb, life3D); 
-    life3D.step();
-    if (life3D.is_empty())
+    Life3DRunnerFrame *slot = queue.wait_push();
+    life3D.snapshot (slot->frame);
+    slot->steps = steps;
+    slot->hold = hold;
+    memcpy (slot->times, times, sizeof (times));
+    queue.end_push();
+    hold = 0;
+    times[FRAME_STAGE_SEED] = 0;
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    if (leap > 0)
+      life3D.advance (1L << leap);
+    else
+      life3D.step();
+    times[FRAME_STAGE_STEP] = ms_since (&start);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    bool empty = life3D.is_empty();
+    times[FRAME_STAGE_IS_EMPTY] = ms_since (&start);
+
+    bool reseed = false;
+    if (empty)
       {
       // All cells dead -- start with a new random selection
-      life3D.seed();
+      reseed = true;
       }
-    if (steps >= gens)
+    else if (steps >= gens)
+      reseed = true;
+    else if (cycle != LIFE3D_CYCLE_IGNORE)
       {
+      // If the pattern has repeated, every frame from now on would be
+      //   one we've already drawn, so there's no point drawing it
+      int period = life3D.get_period();
+      if (period > 0)
+        {
+        log_debug ("Pattern repeats every %d generation(s), after %d\n", 
+          period, steps);
+        // The last picture stays up until the new pattern's first
+        if (cycle == LIFE3D_CYCLE_HOLD)
+          hold = delay * (gens - steps);
+        reseed = true;
+        }
+      }
+    if (reseed)
+      {
+      clock_gettime (CLOCK_MONOTONIC, &start);
       life3D.seed();
+      times[FRAME_STAGE_SEED] = ms_since (&start);
       steps = 0;
       }
-    sleep (delay);
     steps++;
     }
   }
 
+/*==========================================================================
+ 
+  bench
+
+==========================================================================*/
+void Life3DRunner::bench (int generations, std::vector<double> &step_ms, 
+    std::vector<double> &render_ms)
+  {
+  framebuffer_clear (fb);
+  Life3D life3D (size_x, size_y, size_z, filling, engine, boundary);
+  life3D.set_thread_pool (sim_pool);
+  life3D.set_cache_limit (cache_limit);
+  life3D.set_rule (rule);
+  life3D.set_counting (counting);
+  srand (size_x * size_y * size_z);
+  life3D.seed();
+
+  step_ms.clear();
+  render_ms.clear();
+  for (int i = 0; i < generations; i++)
+    {
+    struct timespec start, drawn, stepped;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    life3D.snapshot (shown);
+    if (scene == NULL)
+      build_scene (shown);
+    render (fb, shown); 
+    clock_gettime (CLOCK_MONOTONIC, &drawn);
+    if (leap > 0)
+      life3D.advance (1L << leap);
+    else
+      life3D.step();
+    if (life3D.is_empty())
+      life3D.seed();
+    clock_gettime (CLOCK_MONOTONIC, &stepped);
+    render_ms.push_back (timespec_diff (&drawn, &start) * 1e3);
+    step_ms.push_back (timespec_diff (&stepped, &drawn) * 1e3);
+    }
+  }
+
+/*==========================================================================
+ 
+  cycle_action_from_name
+
+==========================================================================*/
+bool Life3DRunner::cycle_action_from_name (const char *name, 
+    Life3DCycleAction *cycle)
+  {
+  if (strcmp (name, "reseed") == 0)
+    {
+    *cycle = LIFE3D_CYCLE_RESEED;
+    return true;
+    }
+  if (strcmp (name, "hold") == 0)
+    {
+    *cycle = LIFE3D_CYCLE_HOLD;
+    return true;
+    }
+  if (strcmp (name, "ignore") == 0)
+    {
+    *cycle = LIFE3D_CYCLE_IGNORE;
+    return true;
+    }
+  return false;
+  }
+
+/*==========================================================================
+ 
+  renderer_from_name
+
+==========================================================================*/
+bool Life3DRunner::renderer_from_name (const char *name, 
+    Life3DRenderer *renderer)
+  {
+  if (strcmp (name, "lattice") == 0)
+    {
+    *renderer = LIFE3D_RENDERER_LATTICE;
+    return true;
+    }
+  if (strcmp (name, "spheres") == 0)
+    {
+    *renderer = LIFE3D_RENDERER_SPHERES;
+    return true;
+    }
+  return false;
+  }
+
@@ -7,8 +7,64 @@
 ============================================================================*/
 #pragma once
 
+#include <pthread.h>
+#include <vector>
 #include "life3d.h"
 #include "framebuffer.h"
+#include "threadpool.h"
+#include "imager.h"
+#include "spscring.h"
+#include "framestats.h"
+
+// The most generations the simulation may get ahead of the screen
+#define LIFE3D_QUEUE_FRAMES 2
+
+// The simulation has a pool of its own, so that it never waits for
+//   the drawing's; it gets one thread for each this many that draw,
+//   and at least one. Drawing takes much longer than computing, and 
+//   the simulation sleeps once it is far enough ahead.
+#define LIFE3D_SIMULATION_SHARE 4
+
+// Frames that miss their deadlines are reported as a warning at most 
+//   once in this many seconds
+#define LIFE3D_LATE_WARNING_SECONDS 10
+
+/** What the runner does when the pattern starts to repeat itself */
+typedef enum
+  {
+  // Start again with a new random pattern at once
+  LIFE3D_CYCLE_RESEED = 0,
+  // Leave the last picture on the screen, without drawing any more,
+  //   until the generation limit would have been reached; then reseed
+  LIFE3D_CYCLE_HOLD,
+  // Carry on until the generation limit, as if nothing had happened
+  LIFE3D_CYCLE_IGNORE
+  } Life3DCycleAction;
+
+/** How the runner draws the grid */
+typedef enum
+  {
+  // A single SphereLattice solid, which tests each ray only against
+  //   the spheres of the cells it passes through
+  LIFE3D_RENDERER_LATTICE = 0,
+  // A separate Sphere for each live cell, found through the scene's
+  //   bounding volume hierarchy
+  LIFE3D_RENDERER_SPHERES
+  } Life3DRenderer;
+
+/** A generation on its way from the simulation to the screen */
+typedef struct
+  {
+  Life3DFrame frame;
+  // Generations since the grid was last seeded
+  int steps;
+  // Seconds to leave the last picture on the screen before drawing 
+  //   this one
+  double hold;
+  // How long the simulation took over this generation, in ms, 
+  //   indexed by FrameStage; only the simulation's stages are set
+  double times[FRAME_STAGE_COUNT];
+  } Life3DRunnerFrame;
 
 class Life3DRunner
   {
@@ -16,32 +72,130 @@ class Life3DRunner
 
   /** Construct a Life3DRunner object. Arguments:
        fb -- an initialized framebuffer
-       size -- number of cells each of the x, y, and z directions
+       size_x, size_y, size_z -- number of cells in the x, y, and z
+         directions
        pixels -- width and height of the output image
        zoom -- not used; should be 1.0
        q - anti-aliasing quality, 1-4 (probably 1)
        g - gens -- maximum number of generations before restarting
-       delay -- seconds between drawing each generation
+       delay -- seconds from the start of drawing one generation to the
+         start of the next; 0 to draw each as soon as possible
        filling -- proportion of cells initially alive
+       engine -- the method Life3D uses to compute each generation
+       threads -- number of threads to draw with; 0 for one per CPU.
+         The simulation has a quarter as many more of its own.
+       leap -- generations to advance between frames, as a power of two
+       cache_limit -- bytes the HashLife engine may use for its cache
+       rule -- the birth and survival rule
+       boundary -- what lies beyond the faces of the grid
+       counting -- how the dense engine counts neighbours
+       cycle -- what to do when the pattern repeats
+       renderer -- how the grid is turned into a scene
+       adaptive -- anti-alias only the pixels at edges (see 
+         Scene::SetAdaptiveAntiAliasing)
+       stats_file -- file to which run() writes the time each stage of
+         each frame took; NULL for none
   */
-  Life3DRunner (FrameBuffer *fb, int size, int pixels, double zoom, int q,
-                  int gens, int delay, double filling);
+  Life3DRunner (FrameBuffer *fb, int size_x, int size_y, int size_z,
+                  int pixels, double zoom, int q,
+                  int gens, double delay, double filling, 
+                  Life3DEngine engine,
+                  int threads, int leap, size_t cache_limit, 
+                  const Life3DRule &rule, Life3DBoundary boundary,
+                  Life3DCounting counting, Life3DCycleAction cycle,
+                  Life3DRenderer renderer, bool adaptive,
+                  const char *stats_file);
+  ~Life3DRunner (void);
 
-  /** Run the game. Execution continues indefinitely, until ctrl+c */
+  /** Run the game. Execution continues indefinitely, until ctrl+c.
+      The generations are worked out on a thread of their own, which
+      passes each to this one to draw, so that the next is computed 
+      while the last is drawn. The time each stage of the last few 
+      hundred frames took is written to stderr on SIGUSR1. */
   void run (void);
 
+  /** Run the game for the given number of generations as fast as 
+      possible, from a pattern that is the same every time for grids
+      of the same size, on this thread alone, and without looking for
+      cycles; the pattern is only reseeded if it dies out. The times
+      taken to step and to draw each generation are stored in step_ms 
+      and render_ms, in milliseconds. */
+  void bench (int generations, std::vector<double> &step_ms, 
+      std::vector<double> &render_ms);
+
+  /** Look up a cycle action by the name used on the command line 
+      ("reseed", "hold", "ignore"). Returns false if the name is not
+      recognized. */
+  static bool cycle_action_from_name (const char *name, 
+      Life3DCycleAction *cycle);
+
+  /** Look up a renderer by the name used on the command line 
+      ("lattice", "spheres"). Returns false if the name is not
+      recognized. */
+  static bool renderer_from_name (const char *name, 
+      Life3DRenderer *renderer);
+
   protected:
 
-  void render (FrameBuffer *fb, const Life3D &life3D);
+  void build_scene (const Life3DFrame &frame);
+  void render (FrameBuffer *fb, const Life3DFrame &frame);
+  static void *simulate_main (void *arg);
+  void simulate (Life3D &life3D);
+
+  /** The centre of the sphere for cell (x, y, z), in the scene */
+  Imager::Vector cell_centre (int x, int y, int z) const
+    {
+    return Imager::Vector (origin.x + spacing * x, origin.y + spacing * y,
+      origin.z - spacing * z);
+    }
 
   FrameBuffer *fb;
-  int size;
+  int size_x;
+  int size_y;
+  int size_z;
   int pixels;
   double zoom;
   int q;
   int gens;
-  int delay;
+  double delay;
   double filling;
+  Life3DEngine engine;
+  // The drawing's threads, and the simulation's
+  ThreadPool *pool;
+  ThreadPool *sim_pool;
+  int leap;
+  size_t cache_limit;
+  Life3DRule rule;
+  Life3DBoundary boundary;
+  Life3DCounting counting;
+  Life3DCycleAction cycle;
+  Life3DRenderer renderer;
+  bool adaptive;
+  char *stats_file;
+  // The time each stage of the frame being drawn took, in ms, and of
+  //   the last few hundred frames
+  double stage_ms[FRAME_STAGE_COUNT];
+  FrameStats stats;
+  // The grid, which belongs to the simulation thread, and the frames
+  //   it sends to be drawn; and the one being drawn, which the scene
+  //   refers to
+  Life3D *life3D;
+  pthread_t simulator;
+  SpscRing<Life3DRunnerFrame, LIFE3D_QUEUE_FRAMES> queue;
+  Life3DFrame shown;
+  // The scene, which lasts as long as the grid it draws; with the
+  //   spheres renderer, a sphere for each cell, by x, then y, then z;
+  //   and where in the scene the cells are
+  Imager::Scene *scene;
+  std::vector<Imager::Sphere *> spheres;
+  Imager::Vector origin;
+  double spacing;
+  double radius;
+  // The last image drawn, and the ages of the cells in it, so that
+  //   only the parts of the picture where cells changed are redrawn
+  Imager::IncrementalImage *incremental;
+  std::vector<unsigned char> shown_ages;
+  std::vector<Life3DCell> changed;
   };
 
 
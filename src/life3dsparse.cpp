@@ -0,0 +1,137 @@
+/*============================================================================
+
+  life3dsparse.cpp
+
+  Copyright (c)2020-1 Kevin Boone, GPL v3.0
+
+  The sparse engine for Life3D. Only a cell that is alive, or is next
+  to one that is alive, can be alive in the next generation. So we keep
+  a list of the live cells, and in each step visit only them and their
+  neighbours. For a thinly-populated grid this is far less work than
+  visiting every cell.
+
+  The new ages are collected as a list of changes, and applied to the
+  cells array only when every candidate has been worked out, so that
+  the neighbour counts all see the same previous generation.
+
+  Cells are identified by their position in the cells array, which 
+  includes the halo (see life3d.h). Only cells inside the grid are
+  ever candidates.
+
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "life3d.h"
+#include "life3drule.h"
+
+/*===========================================================================
+
+  Life3D::find_live
+
+  Build the list of live cells from scratch. This is needed after
+  seeding, or when the "auto" engine switches from the dense method.
+
+===========================================================================*/
+void Life3D::find_live (void)
+  {
+  live.clear();
+  for (int x = 0; x < size_x; x++)
+    for (int y = 0; y < size_y; y++)
+      {
+      size_t i = index (x, y, 0);
+      for (int z = 0; z < size_z; z++, i++)
+        if (cells[i]) live.push_back (i);
+      }
+  live_valid = true;
+  }
+
+/*===========================================================================
+
+  Life3D::step_sparse
+
+===========================================================================*/
+void Life3D::step_sparse (void)
+  {
+  if (!live_valid) find_live();
+
+  // Every candidate is marked with this step's stamp, so no cell
+  //   is added twice. If the counter wraps, old stamps could match
+  //   again, so start them afresh.
+  stamp_gen++;
+  if (stamp_gen == 0)
+    {
+    memset (stamp, 0, stride_x * (size_x + 2) * sizeof (unsigned));
+    stamp_gen = 1;
+    }
+
+  // A neighbour that lies outside the grid is replaced by the cell
+  //   whose state appears there -- with a mirror boundary, one that is
+  //   a neighbour already -- or skipped if the boundary is dead.
+  candidates.clear();
+  for (size_t k = 0; k < live.size(); k++)
+    {
+    size_t i = live[k];
+    int x = (int)(i / stride_x) - 1;
+    int y = (int)((i / stride_y) % (size_y + 2)) - 1;
+    int z = (int)(i % stride_y) - 1;
+    for (int dx = -1; dx <= 1; dx++)
+      {
+      int nx = edge_source (x + dx, size_x);
+      if (nx < 0) continue;
+      for (int dy = -1; dy <= 1; dy++)
+        {
+        int ny = edge_source (y + dy, size_y);
+        if (ny < 0) continue;
+        for (int dz = -1; dz <= 1; dz++)
+          {
+          int nz = edge_source (z + dz, size_z);
+          if (nz < 0) continue;
+          size_t j = index (nx, ny, nz);
+          if (stamp[j] != stamp_gen)
+            {
+            stamp[j] = stamp_gen;
+            candidates.push_back (j);
+            }
+          }
+        }
+      }
+    }
+
+  changes.clear();
+  next_live.clear();
+  for (size_t k = 0; k < candidates.size(); k++)
+    {
+    size_t i = candidates[k];
+    const int *c = cells + i;
+    int n = 0;
+    for (int o = 0; o < 26; o++)
+      n += c[neighbour_offset[o]] != 0;
+    int age = cells[i];
+    int new_age;
+    if (age)
+      new_age = (transition[n] & LIFE3D_SURVIVES) ? age + 1 : 0;
+    else
+      new_age = (transition[n] & LIFE3D_BORN) ? 1 : 0;
+
+    if (new_age != age)
+      {
+      Change change = { i, new_age };
+      changes.push_back (change);
+      }
+    if (new_age) next_live.push_back (i);
+    }
+
+  for (size_t k = 0; k < changes.size(); k++)
+    {
+    size_t i = changes[k].index;
+    if ((cells[i] != 0) != (changes[k].age != 0)) hash ^= cell_key (i);
+    cells[i] = changes[k].age;
+    }
+  fill_halo();
+
+  live.swap (next_live);
+  population = live.size();
+  }
+
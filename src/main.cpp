@@ -17,6 +17,16 @@
 #include "log.h"
 #include "life3d.h"
 #include "life3drunner.h"
+#include "bench.h"
+
+// Long options that have no short equivalent
+#define OPT_BENCH_COUNTING 1000
+#define OPT_RENDERER 1001
+#define OPT_LOG_LEVEL 1002
+#define OPT_ADAPTIVE 1003
+#define OPT_FPS 1004
+#define OPT_BENCH 1005
+#define OPT_STATS_FILE 1006
 
 /*==========================================================================
  
@@ -38,13 +48,28 @@ void show_version (void)
 void show_help (void)
   {
   printf ("Usage: " NAME " [options]\n");
-  printf (" -d,--delay [seconds]  delay between generations (1)\n");
+  printf ("    --adaptive         anti-alias only pixels at edges\n");
+  printf (" -b,--boundary [name]  torus, dead, or mirror (torus)\n");
+  printf ("    --bench            time drawing and stepping, and exit\n");
+  printf ("    --bench-counting   time neighbour counting methods, and exit\n");
+  printf (" -d,--delay [seconds]  time between generations (1)\n");
+  printf (" -e,--engine [name]    dense, bits, sparse, auto, or hashlife (dense)\n");
   printf (" -f,--fbdev [device]   framebuffer device (/dev/fb0)\n");
+  printf ("    --fps [N]          generations per second, instead of --delay\n");
   printf (" -g,--gens [N]         maximum number of generations (20)\n");
   printf (" -i,--filling [0-1.0]  Proportion of cells initially seeded\n");
+  printf (" -k,--counting [name]  direct or separable (separable)\n");
+  printf (" -l,--leap [k]         advance 2^k generations per frame (0)\n");
+  printf ("    --log-level [0-4]  error, warning, info, debug, trace (2)\n");
+  printf (" -m,--memory [MB]      HashLife cache size, a soft limit (256)\n");
+  printf (" -o,--on-cycle [name]  reseed, hold, or ignore (reseed)\n");
   printf (" -p,--pixels [N]       image size in pixels (quarter screen)\n");
   printf (" -q,--quality [1-4]    anti-aliasing quality (1)\n");
-  printf (" -s,--size [N]         grid size (6)\n");
+  printf ("    --renderer [name]  lattice or spheres (lattice)\n");
+  printf (" -r,--rule [Bn/Sn]     birth and survival rule (B45/S567)\n");
+  printf (" -s,--size [N|XxYxZ]   grid size (6)\n");
+  printf ("    --stats-file [file] write the time each stage of each frame took\n");
+  printf (" -t,--threads [N]      worker threads, 0 for one per CPU (0)\n");
   printf ("\n");
   }
 
@@ -68,8 +93,8 @@ void quit_signal (int dummy)
 ==========================================================================*/
 int main (int argc, char **argv)
   {
-  // N is the size of the cell array -- a cube N x N x N cells
-  int N = 6;
+  // The size of the cell array, NX x NY x NZ cells. By default, a cube
+  int NX = 6, NY = 6, NZ = 6;
   // zoom is the zoom factor for the renderer. The more cells in the grid,
   //   the smaller the zoom will have to be, to see them all
   double zoom = 1;
@@ -81,12 +106,41 @@ int main (int argc, char **argv)
   int q = 1;
   // Maximum number of steps before repopulating the grid
   int gens = 20;
-  // Sleep between generations 
-  int delay = 1;
+  // Seconds from drawing one generation to drawing the next
+  double delay = 1;
+  // Generations to draw each second; if not zero, this sets the delay
+  double fps = 0;
   // Proportion of cells alive in initial seeding
   double filling = 0.5;
   // Enable hiding the cursor
   bool cursor = false;
+  // The method used to compute each generation
+  Life3DEngine engine = LIFE3D_ENGINE_DENSE;
+  // Number of worker threads; zero means one per CPU
+  int threads = 0;
+  // Each frame advances 2^leap generations
+  int leap = 0;
+  // Memory for the HashLife engine's cache, in megabytes
+  int memory = 256;
+  // The rule that decides which cells are born, and which survive
+  Life3DRule rule;
+  Life3D::rule_from_string ("B45/S567", &rule);
+  // What lies beyond the faces of the grid
+  Life3DBoundary boundary = LIFE3D_BOUNDARY_TORUS;
+  // How the dense engine counts neighbours
+  Life3DCounting counting = LIFE3D_COUNTING_SEPARABLE;
+  // Whether to time the neighbour counting methods, and stop
+  bool bench_counting = false;
+  // Whether to time drawing on a virtual framebuffer, and stop
+  bool bench_rendering = false;
+  // What to do when the pattern repeats
+  Life3DCycleAction cycle = LIFE3D_CYCLE_RESEED;
+  // How the grid is turned into a scene for the ray tracer
+  Life3DRenderer renderer = LIFE3D_RENDERER_LATTICE;
+  // Whether to anti-alias only the pixels at edges
+  bool adaptive = false;
+  // File for the time each stage of each frame took, if any
+  char *stats_file = NULL;
 
   bool version = false;
   bool help = false;
@@ -94,15 +148,30 @@ int main (int argc, char **argv)
 
   static struct option long_options[] =
     {
+      {"adaptive", no_argument, NULL, OPT_ADAPTIVE},
+      {"bench", no_argument, NULL, OPT_BENCH},
+      {"bench-counting", no_argument, NULL, OPT_BENCH_COUNTING},
+      {"boundary", required_argument, NULL, 'b'},
       {"cursor", no_argument, NULL, 'c'},
+      {"counting", required_argument, NULL, 'k'},
       {"delay", required_argument, NULL, 'd'},
+      {"engine", required_argument, NULL, 'e'},
       {"fbdev", required_argument, NULL, 'f'},
+      {"fps", required_argument, NULL, OPT_FPS},
       {"filling", required_argument, NULL, 'i'},
       {"gens", required_argument, NULL, 'g'},
       {"help", no_argument, NULL, 'h'},
+      {"leap", required_argument, NULL, 'l'},
+      {"log-level", required_argument, NULL, OPT_LOG_LEVEL},
+      {"memory", required_argument, NULL, 'm'},
+      {"on-cycle", required_argument, NULL, 'o'},
       {"pixels", required_argument, NULL, 'p'},
       {"quality", required_argument, NULL, 'q'},
+      {"renderer", required_argument, NULL, OPT_RENDERER},
+      {"rule", required_argument, NULL, 'r'},
       {"size", required_argument, NULL, 's'},
+      {"stats-file", required_argument, NULL, OPT_STATS_FILE},
+      {"threads", required_argument, NULL, 't'},
       {"version", no_argument, NULL, 'v'},
       {0, 0, 0, 0}
     };
@@ -111,7 +180,7 @@ int main (int argc, char **argv)
    while (carry_on)
      {
      int option_index = 0;
-     opt = getopt_long (argc, argv, "hvf:p:q:g:d:s:i:c", long_options, &option_index);
+     opt = getopt_long (argc, argv, "hvf:p:q:g:d:s:i:ce:t:l:m:r:b:k:o:", long_options, &option_index);
 
      if (opt == -1) break;
 
@@ -138,17 +207,99 @@ int main (int argc, char **argv)
 	 gens = atoi (optarg);
 	 break;
        case 'd': 
-	 delay = atoi (optarg);
+	 delay = atof (optarg);
 	 break;
        case 's': 
-	 N = atoi (optarg);
+         {
+         // Either one size for a cube, or three
+         char dummy;
+         char *end;
+         long cube = strtol (optarg, &end, 10);
+         if (end != optarg && *end == 0)
+           NX = NY = NZ = (int)cube;
+         else if (sscanf (optarg, "%dx%dx%d%c", &NX, &NY, &NZ, &dummy) != 3)
+           {
+           log_error ("'size' argument must be N or XxYxZ\n");
+           carry_on = false;
+           }
+         }
+	 break;
+       case 't': 
+	 threads = atoi (optarg);
 	 break;
        case 'i': 
 	 filling = atof (optarg);
 	 break;
+       case 'l': 
+	 leap = atoi (optarg);
+	 break;
+       case 'm': 
+	 memory = atoi (optarg);
+	 break;
        case 'c': 
 	 cursor = true; 
 	 break;
+       case 'e': 
+         if (!Life3D::engine_from_name (optarg, &engine))
+           {
+           log_error ("Unknown engine '%s'\n", optarg);
+           carry_on = false;
+           }
+	 break;
+       case 'r': 
+         if (!Life3D::rule_from_string (optarg, &rule))
+           {
+           log_error ("Invalid rule '%s'\n", optarg);
+           carry_on = false;
+           }
+	 break;
+       case 'b': 
+         if (!Life3D::boundary_from_name (optarg, &boundary))
+           {
+           log_error ("Unknown boundary '%s'\n", optarg);
+           carry_on = false;
+           }
+	 break;
+       case 'k': 
+         if (!Life3D::counting_from_name (optarg, &counting))
+           {
+           log_error ("Unknown counting method '%s'\n", optarg);
+           carry_on = false;
+           }
+	 break;
+       case 'o': 
+         if (!Life3DRunner::cycle_action_from_name (optarg, &cycle))
+           {
+           log_error ("Unknown cycle action '%s'\n", optarg);
+           carry_on = false;
+           }
+	 break;
+       case OPT_RENDERER: 
+         if (!Life3DRunner::renderer_from_name (optarg, &renderer))
+           {
+           log_error ("Unknown renderer '%s'\n", optarg);
+           carry_on = false;
+           }
+	 break;
+       case OPT_LOG_LEVEL: 
+         log_set_level (atoi (optarg));
+	 break;
+       case OPT_FPS: 
+	 fps = atof (optarg);
+	 break;
+       case OPT_ADAPTIVE: 
+	 adaptive = true; 
+	 break;
+       case OPT_BENCH_COUNTING: 
+	 bench_counting = true; 
+	 break;
+       case OPT_BENCH: 
+	 bench_rendering = true; 
+	 break;
+       case OPT_STATS_FILE: 
+	 free (stats_file);
+	 stats_file = strdup (optarg);
+	 break;
        default:
          carry_on = false; 
        }
@@ -186,6 +337,64 @@ int main (int argc, char **argv)
       }
     }
   
+  if (carry_on)
+    {
+    if (NX < 1 || NY < 1 || NZ < 1)
+      {
+      log_error ("'size' arguments must be at least 1\n");
+      carry_on = false;
+      }
+    }
+
+  if (carry_on)
+    {
+    if (leap < 0 || leap > 62)
+      {
+      log_error ("'leap' argument must be in range 0-62\n");
+      carry_on = false;
+      }
+    }
+
+  if (carry_on)
+    {
+    if (delay < 0.0)
+      {
+      log_error ("'delay' argument must not be negative\n");
+      carry_on = false;
+      }
+    else if (fps < 0.0)
+      {
+      log_error ("'fps' argument must not be negative\n");
+      carry_on = false;
+      }
+    else if (fps > 0.0)
+      delay = 1.0 / fps;
+    }
+
+  if (carry_on)
+    {
+    if (memory < 1)
+      {
+      log_error ("'memory' argument must be at least 1\n");
+      carry_on = false;
+      }
+    }
+  
+  if (carry_on && bench_counting)
+    {
+    // The flag hides the function of the same name
+    ::bench_counting (threads, filling, rule, boundary);
+    carry_on = false;
+    }
+
+  if (carry_on && bench_rendering)
+    {
+    bench_render (gens, pixels > 0 ? pixels : BENCH_PIXELS, threads, filling,
+      engine, leap, (size_t)memory * 1024 * 1024, rule, boundary, counting,
+      renderer, adaptive);
+    carry_on = false;
+    }
+
   if (carry_on)
     {
     FrameBuffer *fb = framebuffer_create (fbdev);
@@ -224,7 +433,9 @@ int main (int argc, char **argv)
       if (pixels > max) pixels = max;
 
 
-      Life3DRunner runner (fb, N, pixels, zoom, q, gens, delay, filling);
+      Life3DRunner runner (fb, NX, NY, NZ, pixels, zoom, q, gens, delay, filling,
+        engine, threads, leap, (size_t)memory * 1024 * 1024, rule, boundary, counting, cycle,
+        renderer, adaptive, stats_file);
       runner.run();
       }
     else
@@ -234,6 +445,7 @@ int main (int argc, char **argv)
     }
 
   free (fbdev);
+  free (stats_file);
 
   return 0;
   }
@@ -28,11 +28,17 @@
     SolidObjects and LightSources that illuminate them.
 */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <stdint.h>
 #include "imager.h"
 #include "framebuffer.h"
+#include "threadpool.h"
 
 namespace Imager
 {
@@ -61,6 +67,18 @@ namespace Imager
     // difference to the image.
     const double MIN_OPTICAL_INTENSITY = 0.001;
 
+    // KB -- The time since 'start', in milliseconds.
+    inline double MillisecondsSince(
+        const std::chrono::steady_clock::time_point& start)
+    {
+        return std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+#if RAYTRACE_COUNTERS
+    thread_local RayCounters threadRayCounters;
+#endif
+
     inline bool IsSignificant(const Color& color)
     {
         return
@@ -69,12 +87,13 @@ namespace Imager
             (color.blue  >= MIN_OPTICAL_INTENSITY);
     }
 
-    Color Scene::TraceRay(
+    bool Scene::TraceRay(
         const Vector& vantage,
         const Vector& direction,
         double refractiveIndex,
         Color rayIntensity,
-        int recursionDepth) const
+        int recursionDepth,
+        Color& outColor) const
     {
         Intersection intersection;
         const int numClosest = FindClosestIntersection(
@@ -82,13 +101,33 @@ namespace Imager
             direction, 
             intersection);
 
+        return TraceFromIntersection(
+            numClosest,
+            intersection,
+            direction,
+            refractiveIndex,
+            rayIntensity,
+            recursionDepth,
+            outColor);
+    }
+
+    bool Scene::TraceFromIntersection(
+        int numClosest,
+        const Intersection& intersection,
+        const Vector& direction,
+        double refractiveIndex,
+        Color rayIntensity,
+        int recursionDepth,
+        Color& outColor) const
+    {
         switch (numClosest)
         {
         case 0:
             // The ray of light did not hit anything.
             // Therefore we see the background color attenuated
             // by the incoming ray intensity.
-            return rayIntensity * backgroundColor;
+            outColor = rayIntensity * backgroundColor;
+            return true;
 
         case 1:
             // The ray of light struck exactly one closest surface.
@@ -98,26 +137,28 @@ namespace Imager
                 direction,
                 refractiveIndex,
                 rayIntensity,
-                1 + recursionDepth);
+                1 + recursionDepth,
+                outColor);
 
         default:
             // There is an ambiguity: more than one intersection
-            // has the same minimum distance.  Caller must catch
-            // this exception and have a backup plan for handling
-            // this ray of light.
-            throw AmbiguousIntersectionException();
+            // has the same minimum distance.  Caller must
+            // have a backup plan for handling this ray of light.
+            RAYTRACE_COUNT(ambiguities, 1);
+            return false;
         }
     }
 
     // Determines the color of an intersection, 
     // based on illumination it receives via scattering,
     // glossy reflection, and refraction (lensing).
-    Color Scene::CalculateLighting(
+    bool Scene::CalculateLighting(
         const Intersection& intersection, 
         const Vector& direction, 
         double refractiveIndex,
         Color rayIntensity,
-        int recursionDepth) const
+        int recursionDepth,
+        Color& outColor) const
     {
         Color colorSum(0.0, 0.0, 0.0);
 
@@ -219,14 +260,19 @@ namespace Imager
                     // Note that only the 'transparent' part of the light
                     // is available for refraction and refractive reflection.
 
-                    colorSum += CalculateRefraction(
+                    Color refractionColor;
+                    if (!CalculateRefraction(
                         intersection, 
                         direction,
                         refractiveIndex,
                         transparency * rayIntensity,
                         recursionDepth,
-                        refractiveReflectionFactor  // output parameter
-                    );
+                        refractiveReflectionFactor, // output parameter
+                        refractionColor))           // output parameter
+                    {
+                        return false;
+                    }
+                    colorSum += refractionColor;
                 }
 
                 // There are two sources of shiny reflection
@@ -254,12 +300,17 @@ namespace Imager
 
                 if (IsSignificant(reflectionColor))
                 {
-                    const Color matteColor = CalculateReflection(
+                    Color matteColor;
+                    if (!CalculateReflection(
                         intersection,
                         direction,
                         refractiveIndex,
                         reflectionColor,
-                        recursionDepth);
+                        recursionDepth,
+                        matteColor))
+                    {
+                        return false;
+                    }
 
                     colorSum += matteColor;
                 }
@@ -277,7 +328,42 @@ namespace Imager
         }
 #endif
 
-        return colorSum;
+        outColor = colorSum;
+        return true;
+    }
+
+    // KB -- When nothing in the scene lets light through or mirrors 
+    // it, the color at a point is just its matte color lit by the 
+    // light sources it can see.  This is what CalculateLighting 
+    // works out in that case, without all the tests for reflection
+    // and refraction, and gives exactly the same colors.
+    bool Scene::ShadeOpaqueMatte(
+        int numClosest,
+        const Intersection& intersection,
+        Color& outColor) const
+    {
+        switch (numClosest)
+        {
+        case 0:
+            outColor = backgroundColor;
+            return true;
+
+        case 1:
+            if (intersection.solid == NULL)
+            {
+                throw ImagerException("Undefined solid at intersection.");
+            }
+            outColor = 
+                intersection.solid->SurfaceOptics(
+                    intersection.point, 
+                    intersection.context).GetMatteColor() *
+                CalculateMatte(intersection);
+            return true;
+
+        default:
+            RAYTRACE_COUNT(ambiguities, 1);
+            return false;
+        }
     }
 
     // Determines the contribution of the illumination of a point
@@ -292,17 +378,15 @@ namespace Imager
         Color colorSum(0.0, 0.0, 0.0);
 
         // Iterate through all of the light sources.
-        LightSourceList::const_iterator iter = lightSourceList.begin();
-        LightSourceList::const_iterator end  = lightSourceList.end();
-        for (; iter != end; ++iter)
+        for (size_t lightIndex=0; lightIndex < lightSourceList.size(); ++lightIndex)
         {
             // Each time through the loop, 'source' 
             // will refer to one of the light sources.
-            const LightSource& source = *iter;  
+            const LightSource& source = lightSourceList[lightIndex];  
 
             // See if we can draw a line from the intersection 
             // point toward the light source without hitting any surfaces.
-            if (HasClearLineOfSight(intersection.point, source.location))
+            if (HasClearLineOfSight(intersection.point, source.location, lightIndex))
             {
                 // Since there is nothing between this point on the object's 
                 // surface and the given light source, add this light source's 
@@ -339,12 +423,13 @@ namespace Imager
     }
 
 
-    Color Scene::CalculateReflection(
+    bool Scene::CalculateReflection(
         const Intersection& intersection, 
         const Vector& incidentDir, 
         double refractiveIndex,
         Color rayIntensity,
-        int recursionDepth) const
+        int recursionDepth,
+        Color& outColor) const
     {
         // Find the direction of the reflected ray based on the incident ray 
         // direction and the surface normal vector.  The reflected ray has
@@ -355,22 +440,26 @@ namespace Imager
         const double perp = 2.0 * DotProduct(incidentDir, normal);
         const Vector reflectDir = incidentDir - (perp * normal);
 
+        RAYTRACE_COUNT(reflectionRays, 1);
+
         // Follow the ray in the new direction from the intersection point.
         return TraceRay(
             intersection.point,
             reflectDir,
             refractiveIndex,
             rayIntensity,
-            recursionDepth);
+            recursionDepth,
+            outColor);
     }
 
-    Color Scene::CalculateRefraction(
+    bool Scene::CalculateRefraction(
         const Intersection& intersection, 
         const Vector& direction, 
         double sourceRefractiveIndex,
         Color rayIntensity,
         int recursionDepth,
-        double& outReflectionFactor) const
+        double& outReflectionFactor,
+        Color& outColor) const
     {
         // Convert direction to a unit vector so that
         // relation between angle and dot product is simpler.
@@ -454,8 +543,9 @@ namespace Imager
             // there is no such real angle a2, which in turn
             // means that the ray experiences total internal reflection,
             // so that no refracted ray exists.
-            outReflectionFactor = 1.0;      // complete reflection
-            return Color(0.0, 0.0, 0.0);    // no refraction at all
+            outReflectionFactor = 1.0;          // complete reflection
+            outColor = Color(0.0, 0.0, 0.0);    // no refraction at all
+            return true;
         }
 
         // Getting here means there is at least a little bit of
@@ -540,13 +630,16 @@ namespace Imager
         const Color nextRayIntensity = 
             (1.0 - outReflectionFactor) * rayIntensity;
 
+        RAYTRACE_COUNT(refractionRays, 1);
+
         // Follow the ray in the new direction from the intersection point.
         return TraceRay(
             intersection.point,
             refractDir,
             targetRefractiveIndex,
             nextRayIntensity,
-            recursionDepth);
+            recursionDepth,
+            outColor);
     }
 
     double Scene::PolarizedReflection(
@@ -644,69 +737,755 @@ namespace Imager
     // return 3).  If this function returns a value greater than zero,
     // it means the 'intersection' parameter has been filled in with the
     // closest intersection (or one of the equally closest intersections).
+    // KB -- the work is done by the bounding volume hierarchy, which 
+    // tests only the solids whose boxes the ray passes through.
     int Scene::FindClosestIntersection(
         const Vector& vantage, 
         const Vector& direction, 
         Intersection& intersection) const
     {
-        // Build a list of all intersections from all objects.
-        cachedIntersectionList.clear();     // empty any previous contents
-        SolidObjectList::const_iterator iter = solidObjectList.begin();
-        SolidObjectList::const_iterator end  = solidObjectList.end();
-        for (; iter != end; ++iter)
-        {
-            const SolidObject& solid = *(*iter);
-            solid.AppendAllIntersections(
-                vantage, 
-                direction, 
-                cachedIntersectionList);
-        }
-        return PickClosestIntersection(cachedIntersectionList, intersection);
+        return bvh.FindClosestIntersection(vantage, direction, intersection);
     }
 
 
     // Returns true if nothing blocks a line drawn between point1 and point2.
+    namespace
+    {
+        // KB -- For each light, the solid that last blocked a shadow ray
+        // towards it on this thread.  Neighbouring pixels are usually
+        // in the shadow of the same solid, so it is worth trying that 
+        // one before any other.  The pointers are only good for the
+        // SaveImage whose renderSerial is 'serial'.
+        struct OccluderCache
+        {
+            unsigned long serial;
+            std::vector<const SolidObject*> lastOccluder;
+
+            OccluderCache()
+                : serial(0)
+            {
+            }
+        };
+
+        thread_local OccluderCache occluderCache;
+
+        std::atomic<unsigned long> nextRenderSerial(1);
+    }
+
     bool Scene::HasClearLineOfSight(
         const Vector& point1, 
-        const Vector& point2) const
+        const Vector& point2,
+        size_t lightIndex) const
     {
-        // Subtract point2 from point1 to obtain the direction
-        // from point1 to point2, along with the square of
-        // the distance between the two points.
+        // Anything that blocks the line of sight has an intersection
+        // closer to point1 than point2 is.
         const Vector dir = point2 - point1;
-        const double gapDistanceSquared = dir.MagnitudeSquared();
+        RAYTRACE_COUNT(shadowRays, 1);
 
-        // Iterate through all the solid objects in this scene.
-        SolidObjectList::const_iterator iter = solidObjectList.begin();
-        SolidObjectList::const_iterator end  = solidObjectList.end();
-        for (; iter != end; ++iter)
+        OccluderCache& cache = occluderCache;
+        if (cache.serial != renderSerial)
+        {
+            cache.serial = renderSerial;
+            cache.lastOccluder.assign(lightSourceList.size(), NULL);
+        }
+
+        const SolidObject*& last = cache.lastOccluder[lightIndex];
+        if (last != NULL)
+        {
+            RAYTRACE_COUNT(solidTests, 1);
+            if (last->HasIntersectionBefore(point1, dir))
+            {
+                return false;
+            }
+        }
+
+        const SolidObject* blocker = bvh.FindBlocker(point1, dir, last);
+        if (blocker != NULL)
+        {
+            last = blocker;
+            return false;
+        }
+        return true;
+    }
+
+    // KB -- SaveImage traces the oversampled image in square tiles
+    // of this many pixels on a side.  This is small enough that there
+    // are plenty of tiles to go round, so that a worker that finishes
+    // its own share early can take over part of another's.
+    const size_t TILE_SIZE = 16;
+
+    // KB -- Adaptive anti-aliasing refines a pixel if its color differs
+    // from a neighbor's by more than this fraction of the brightest
+    // color component in the image.
+    const double ADAPTIVE_COLOR_THRESHOLD = 1.0 / 16.0;
+
+    namespace
+    {
+        // KB -- A work-stealing queue of tiles.  Each worker starts with
+        // its own run of consecutive tiles, and takes them from the front.
+        // Tiles differ a great deal in cost -- one of empty background
+        // costs almost nothing, and one full of shadowed spheres a lot --
+        // so a worker that runs out steals from the back of another's run.
+        // Each run is two 32-bit tile numbers packed into one atomic word,
+        // the first in the low half and the end in the high half, so the
+        // owner and the thieves can each take a tile with a single
+        // compare-and-swap.
+        class TileQueue
+        {
+        public:
+            TileQueue(size_t numTiles, int _numWorkers)
+                : numWorkers(_numWorkers)
+                , runs(new Run[_numWorkers])
+            {
+                for (int w=0; w < numWorkers; ++w)
+                {
+                    const uint64_t first = numTiles * w / numWorkers;
+                    const uint64_t end   = numTiles * (w + 1) / numWorkers;
+                    runs[w].range.store(first | (end << 32));
+                }
+            }
+
+            ~TileQueue()
+            {
+                delete[] runs;
+            }
+
+            // Sets 'tile' to the next tile for the given worker to 
+            // render and returns true, or returns false if every tile
+            // has been taken.
+            bool Next(int worker, size_t& tile)
+            {
+                if (Take(runs[worker], false, tile))
+                {
+                    return true;
+                }
+                for (int k=1; k < numWorkers; ++k)
+                {
+                    if (Take(runs[(worker + k) % numWorkers], true, tile))
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+        private:
+            // Each run has a cache line to itself, so that workers
+            // taking from their own runs do not slow each other down.
+            struct alignas(64) Run
+            {
+                std::atomic<uint64_t> range;
+            };
+
+            static bool Take(Run& run, bool fromBack, size_t& tile)
+            {
+                uint64_t range = run.range.load();
+                for (;;)
+                {
+                    uint64_t first = range & 0xffffffff;
+                    uint64_t end   = range >> 32;
+                    if (first >= end)
+                    {
+                        return false;
+                    }
+                    tile = fromBack ? --end : first++;
+                    if (run.range.compare_exchange_weak(range, first | (end << 32)))
+                    {
+                        return true;
+                    }
+                }
+            }
+
+            TileQueue(const TileQueue&);
+            TileQueue& operator= (const TileQueue&);
+
+            const int numWorkers;
+            Run* runs;
+        };
+
+        // KB -- Which of the oversampled pixels a pass of SaveImage
+        // traces.  Each pixel of the final image is a square block of
+        // antiAliasFactor x antiAliasFactor samples.
+        enum SampleSet
+        {
+            SAMPLE_ALL,         // every sample
+            SAMPLE_CENTERS,     // the sample at the middle of each block
+            SAMPLE_REFINED      // the rest of the samples of refined pixels
+        };
+    }
+
+    // KB -- What the workers of a SaveImage need to share.
+    struct Scene::RenderJob
+    {
+        const Scene* scene;
+        ImageBuffer* buffer;
+        TileQueue* tiles;
+        size_t tilesWide;
+        double largeZoom;
+
+        // The tiles to trace, or NULL for all of them.  Otherwise the
+        // queue hands out positions in this list.
+        const std::vector<size_t>* tileList;
+
+        // How many rays from the camera to trace together, or zero
+        // to trace them one at a time.
+        int packetWidth;
+
+        // Whether every solid is opaque and matte, so that rays 
+        // from the camera can go to ShadeOpaqueMatte.
+        bool opaqueMatte;
+
+        // Which samples the present pass traces, and, for 
+        // SAMPLE_REFINED, the pixels of the final image that need all
+        // of their samples (nonzero), by row.
+        SampleSet samples;
+        size_t antiAliasFactor;
+        size_t pixelsWide;
+        std::vector<unsigned char> refine;
+
+        bool IsCenter(size_t i, size_t j) const
+        {
+            return 
+                (i % antiAliasFactor == antiAliasFactor / 2) &&
+                (j % antiAliasFactor == antiAliasFactor / 2);
+        }
+
+        bool IsTraced(size_t i, size_t j) const
+        {
+            switch (samples)
+            {
+            case SAMPLE_CENTERS:
+                return IsCenter(i, j);
+
+            case SAMPLE_REFINED:
+                return 
+                    refine[(j / antiAliasFactor) * pixelsWide + (i / antiAliasFactor)] &&
+                    !IsCenter(i, j);
+
+            default:
+                return true;
+            }
+        }
+
+        // Each worker keeps its own list of the pixels it could not
+        // trace definitive rays for.
+        std::vector<PixelList> ambiguousPixelLists;
+
+        // The message of the first ImagerException any worker caught,
+        // so that SaveImage can throw it again on the calling thread.
+        std::atomic<const char*> failure;
+
+        // What each worker's thread counted while it worked on this job.
+        std::vector<RayCounters> rayCounters;
+    };
+
+    // KB -- The job each worker runs for SaveImage: render tiles until
+    // there are none left.
+    void Scene::RenderTiles(int worker, int workers, void* data)
+    {
+        RenderJob& job = *static_cast<RenderJob*>(data);
+        const Scene& scene = *job.scene;
+        ImageBuffer& buffer = *job.buffer;
+        const size_t largePixelsWide = buffer.GetPixelsWide();
+        const size_t largePixelsHigh = buffer.GetPixelsHigh();
+        PixelList& ambiguousPixelList = job.ambiguousPixelLists[worker];
+
+        // The camera is located at the origin.
+        const Vector camera(0.0, 0.0, 0.0);
+
+        // The camera faces in the -z direction.
+        // This allows the +x direction to be to the right,
+        // and the +y direction to be upward.
+        Vector direction(0.0, 0.0, -1);
+
+        const Color fullIntensity(1.0, 1.0, 1.0);
+
+#if RAYTRACE_COUNTERS
+        const RayCounters countersBefore = threadRayCounters;
+#endif
+
+        try
+        {
+            size_t tile;
+            while (job.tiles->Next(worker, tile))
+            {
+                if (job.tileList != NULL)
+                {
+                    tile = (*job.tileList)[tile];
+                }
+                const size_t iMin = (tile % job.tilesWide) * TILE_SIZE;
+                const size_t jMin = (tile / job.tilesWide) * TILE_SIZE;
+                const size_t iMax = std::min(iMin + TILE_SIZE, largePixelsWide);
+                const size_t jMax = std::min(jMin + TILE_SIZE, largePixelsHigh);
+
+                for (size_t j=jMin; j < jMax; ++j)
+                {
+                    direction.y = (largePixelsHigh/2.0 - j) / job.largeZoom;
+
+                    // The columns of this row of the tile to trace in
+                    // this pass.
+                    size_t columns[TILE_SIZE];
+                    size_t numColumns = 0;
+                    for (size_t i=iMin; i < iMax; ++i)
+                    {
+                        if (job.IsTraced(i, j))
+                        {
+                            columns[numColumns++] = i;
+                        }
+                    }
+
+                    // Neighbouring rays from the camera take much the same
+                    // path through the hierarchy, so find the sphere each
+                    // ray of this row of the tile hits first, several rays
+                    // at a time.  Only the shading is then done ray by ray.
+                    const SolidObject* firstHit[TILE_SIZE];
+                    bool nearTie[TILE_SIZE];
+                    if (job.packetWidth > 0)
+                    {
+                        Vector rowDirections[TILE_SIZE];
+                        for (size_t c=0; c < numColumns; ++c)
+                        {
+                            rowDirections[c] = Vector(
+                                (columns[c] - largePixelsWide/2.0) / job.largeZoom,
+                                direction.y,
+                                direction.z);
+                        }
+                        for (size_t c=0; c < numColumns; c += job.packetWidth)
+                        {
+                            scene.bvh.FindClosestSpheres(
+                                camera,
+                                rowDirections + c,
+                                static_cast<int>(std::min<size_t>(job.packetWidth, numColumns - c)),
+                                firstHit + c,
+                                nearTie + c);
+                        }
+                    }
+
+                    for (size_t c=0; c < numColumns; ++c)
+                    {
+                        const size_t i = columns[c];
+                        direction.x = (i - largePixelsWide/2.0) / job.largeZoom;
+
+#if RAYTRACE_DEBUG_POINTS
+                        {
+                            using namespace std;
+
+                            // Assume no active debug point unless we find one below.
+                            scene.activeDebugPoint = NULL;    
+
+                            DebugPointList::const_iterator iter = scene.debugPointList.begin();
+                            DebugPointList::const_iterator end  = scene.debugPointList.end();
+                            for(; iter != end; ++iter)
+                            {
+                                if ((iter->iPixel == i) && (iter->jPixel == j))
+                                {
+                                    cout << endl;
+                                    cout << "Hit breakpoint at (";
+                                    cout << i << ", " << j <<")" << endl;
+                                    scene.activeDebugPoint = &(*iter);
+                                    break;
+                                }
+                            }
+                        }
+#endif
+
+                        // Trace a ray from the camera toward the given direction
+                        // to figure out what color to assign to this pixel.
+                        RAYTRACE_COUNT(primaryRays, 1);
+                        Intersection intersection;
+                        int numClosest = 0;
+                        if (job.packetWidth > 0 && !nearTie[c])
+                        {
+                            const SolidObject* solid = firstHit[c];
+                            if (solid != NULL)
+                            {
+                                RAYTRACE_COUNT(solidTests, 1);
+                                numClosest = solid->FindClosestIntersection(
+                                    camera, 
+                                    direction, 
+                                    intersection);
+                            }
+                        }
+                        else
+                        {
+                            // Without packets, or when two spheres may tie
+                            // for the closest, which only the full search
+                            // can tell.
+                            numClosest = scene.FindClosestIntersection(
+                                camera, 
+                                direction, 
+                                intersection);
+                        }
+
+                        // The buffer may hold what was there last time.
+                        PixelData& pixel = buffer.Pixel(i,j);
+                        pixel = PixelData();
+                        if (numClosest == 1)
+                        {
+                            pixel.solid = intersection.solid;
+                            pixel.context = intersection.context;
+                        }
+                        const bool traced = job.opaqueMatte ?
+                            scene.ShadeOpaqueMatte(
+                                numClosest,
+                                intersection,
+                                pixel.color) :
+                            scene.TraceFromIntersection(
+                                numClosest,
+                                intersection,
+                                direction,
+                                scene.ambientRefraction,
+                                fullIntensity,
+                                0,
+                                pixel.color);
+
+                        if (!traced)
+                        {
+                            // Getting here means that somewhere in the recursive 
+                            // code for tracing rays, there were multiple 
+                            // intersections that had minimum distance from a 
+                            // vantage point.  This can be really bad, 
+                            // for example causing a ray of light to reflect 
+                            // inward into a solid.
+
+                            // Mark the pixel as ambiguous, so that any other
+                            // ambiguous pixels nearby know not to use it.
+                            pixel.isAmbiguous = true;
+
+                            // Keep a list of all ambiguous pixel coordinates
+                            // so that we can rapidly enumerate through them
+                            // in the disambiguation pass.
+                            ambiguousPixelList.push_back(PixelCoordinates(i, j));
+                        }
+                    }
+                }
+            }
+        }
+        catch (const ImagerException& e)
+        {
+            // An exception cannot cross from one thread to another,
+            // so just record it.  This worker stops, and the others
+            // finish what is left.
+            const char* none = NULL;
+            job.failure.compare_exchange_strong(none, e.GetMessage());
+        }
+
+#if RAYTRACE_COUNTERS
+        RayCounters counted = threadRayCounters;
+        counted -= countersBefore;
+        job.rayCounters[worker] += counted;
+#endif
+    }
+
+    // KB -- After the first pass of adaptive anti-aliasing, which
+    // traced only the middle sample of each pixel, marks in job.refine
+    // each pixel whose sample differs from that of a neighbor: the ray
+    // hit a different solid, or none, or the colors differ noticeably.
+    // Pixels whose rays were ambiguous are always refined.  Returns 
+    // the number of pixels marked.
+    size_t Scene::FindEdgePixels(const ImageBuffer& buffer, RenderJob& job) const
+    {
+        const size_t factor = job.antiAliasFactor;
+        const size_t pixelsWide = buffer.GetPixelsWide() / factor;
+        const size_t pixelsHigh = buffer.GetPixelsHigh() / factor;
+        job.refine.assign(pixelsWide * pixelsHigh, 0);
+
+        double max = 0.0;
+        for (size_t j=0; j < pixelsHigh; ++j)
+        {
+            for (size_t i=0; i < pixelsWide; ++i)
+            {
+                const Color& color = 
+                    buffer.Pixel(i*factor + factor/2, j*factor + factor/2).color;
+                max = std::max(max, std::max(color.red, std::max(color.green, color.blue)));
+            }
+        }
+        const double threshold = ADAPTIVE_COLOR_THRESHOLD * max;
+
+        size_t count = 0;
+        for (size_t j=0; j < pixelsHigh; ++j)
         {
-            // If any object blocks the line of sight, 
-            // we can return false immediately.
-            const SolidObject& solid = *(*iter);
+            for (size_t i=0; i < pixelsWide; ++i)
+            {
+                const PixelData& pixel = 
+                    buffer.Pixel(i*factor + factor/2, j*factor + factor/2);
+
+                // Compare with the pixels to the right and below; 
+                // those to the left and above have compared with this.
+                bool edge = pixel.isAmbiguous;
+                for (int n=0; n < 2 && !edge; ++n)
+                {
+                    const size_t ni = (n == 0) ? i + 1 : i;
+                    const size_t nj = (n == 0) ? j : j + 1;
+                    if (ni >= pixelsWide || nj >= pixelsHigh)
+                    {
+                        continue;
+                    }
+                    const PixelData& neighbor = 
+                        buffer.Pixel(ni*factor + factor/2, nj*factor + factor/2);
+                    if (neighbor.isAmbiguous ||
+                        pixel.solid != neighbor.solid ||
+                        pixel.context != neighbor.context ||
+                        fabs(pixel.color.red   - neighbor.color.red)   > threshold ||
+                        fabs(pixel.color.green - neighbor.color.green) > threshold ||
+                        fabs(pixel.color.blue  - neighbor.color.blue)  > threshold)
+                    {
+                        edge = true;
+                        if (!job.refine[nj * pixelsWide + ni])
+                        {
+                            job.refine[nj * pixelsWide + ni] = 1;
+                            ++count;
+                        }
+                    }
+                }
+                if (edge && !job.refine[j * pixelsWide + i])
+                {
+                    job.refine[j * pixelsWide + i] = 1;
+                    ++count;
+                }
+            }
+        }
+        return count;
+    }
 
-            // Find the closest intersection from point1
-            // in the direction toward point2.
-            Intersection closest;
-            if (0 != solid.FindClosestIntersection(point1, dir, closest))
+    // KB -- After adaptive anti-aliasing, copies the one sample traced
+    // for each pixel that was not refined to the rest of its samples.
+    void Scene::FillSmoothPixels(ImageBuffer& buffer, const RenderJob& job) const
+    {
+        const size_t factor = job.antiAliasFactor;
+        const size_t pixelsHigh = buffer.GetPixelsHigh() / factor;
+        for (size_t j=0; j < pixelsHigh; ++j)
+        {
+            for (size_t i=0; i < job.pixelsWide; ++i)
             {
-                // We found the closest intersection, but it is only
-                // a blocker if it is closer to point1 than point2 is.
-                // If the closest intersection is farther away than
-                // point2, there is nothing on this object blocking
-                // the line of sight.
+                if (job.refine[j * job.pixelsWide + i])
+                {
+                    continue;
+                }
+                const PixelData center = 
+                    buffer.Pixel(i*factor + factor/2, j*factor + factor/2);
+                for (size_t y=0; y < factor; ++y)
+                {
+                    for (size_t x=0; x < factor; ++x)
+                    {
+                        buffer.Pixel(i*factor + x, j*factor + y) = center;
+                    }
+                }
+            }
+        }
+    }
 
-                if (closest.distanceSquared < gapDistanceSquared)
+    // KB -- The most slices into which FindChangedTiles cuts the cone
+    // of shadow behind a change.
+    const int MAX_SHADOW_SLICES = 16;
+
+    namespace
+    {
+        // KB -- Marks in 'changed' (one flag for each tile, by row) 
+        // the tiles holding pixels whose rays from the camera might
+        // pass through 'box'.  Returns false if the box reaches behind
+        // the camera, so that no such set of tiles can be found.
+        bool MarkTilesSeeing(
+            const BoundingBox& box,
+            double largeZoom,
+            size_t largePixelsWide,
+            size_t largePixelsHigh,
+            size_t tilesWide,
+            std::vector<unsigned char>& changed)
+        {
+            if (box.maxCorner.z > -EPSILON)
+            {
+                return false;
+            }
+
+            // The ray for pixel (i,j) runs along 
+            // ((i - wide/2) / zoom, (high/2 - j) / zoom, -1), 
+            // so a point (x,y,z) lies on the ray of pixel 
+            // (wide/2 + zoom*x/-z, high/2 - zoom*y/-z).  The box is
+            // convex, so all of it lies within the range of its corners.
+            double iMin = HUGE_VAL;
+            double iMax = -HUGE_VAL;
+            double jMin = HUGE_VAL;
+            double jMax = -HUGE_VAL;
+            for (int corner=0; corner < 8; ++corner)
+            {
+                const double x = (corner & 1) ? box.maxCorner.x : box.minCorner.x;
+                const double y = (corner & 2) ? box.maxCorner.y : box.minCorner.y;
+                const double z = (corner & 4) ? box.maxCorner.z : box.minCorner.z;
+                const double i = largePixelsWide/2.0 + largeZoom * x / -z;
+                const double j = largePixelsHigh/2.0 - largeZoom * y / -z;
+                iMin = std::min(iMin, i);
+                iMax = std::max(iMax, i);
+                jMin = std::min(jMin, j);
+                jMax = std::max(jMax, j);
+            }
+
+            // Allow a pixel either way for rounding.
+            if (iMax < -1.0 || jMax < -1.0 ||
+                iMin > largePixelsWide || jMin > largePixelsHigh)
+            {
+                return true;
+            }
+            const size_t iFirst = static_cast<size_t>(std::max(0.0, iMin - 1.0));
+            const size_t jFirst = static_cast<size_t>(std::max(0.0, jMin - 1.0));
+            const size_t iLast = std::min(
+                largePixelsWide - 1, static_cast<size_t>(iMax + 1.0));
+            const size_t jLast = std::min(
+                largePixelsHigh - 1, static_cast<size_t>(jMax + 1.0));
+            for (size_t tj = jFirst / TILE_SIZE; tj <= jLast / TILE_SIZE; ++tj)
+            {
+                for (size_t ti = iFirst / TILE_SIZE; ti <= iLast / TILE_SIZE; ++ti)
+                {
+                    changed[tj * tilesWide + ti] = 1;
+                }
+            }
+            return true;
+        }
+
+        // KB -- As MarkTilesSeeing, for the part of 'box' inside 'within'.
+        bool MarkTilesSeeingPart(
+            const BoundingBox& box,
+            const BoundingBox& within,
+            double largeZoom,
+            size_t largePixelsWide,
+            size_t largePixelsHigh,
+            size_t tilesWide,
+            std::vector<unsigned char>& changed)
+        {
+            BoundingBox part = box;
+            part.Restrict(within);
+            if (part.minCorner.x > part.maxCorner.x ||
+                part.minCorner.y > part.maxCorner.y ||
+                part.minCorner.z > part.maxCorner.z)
+            {
+                return true;
+            }
+            return MarkTilesSeeing(part, largeZoom, largePixelsWide, 
+                largePixelsHigh, tilesWide, changed);
+        }
+    }
+
+    // KB -- Lists in changedTiles the tiles whose pixels may look
+    // different because of the changes recorded in 'image': those in
+    // which a changed place can be seen, and those in which a surface
+    // might now be in or out of its shadow.  Returns false if that 
+    // cannot be worked out, and every tile must be traced.
+    bool Scene::FindChangedTiles(
+        const IncrementalImage& image,
+        double largeZoom,
+        size_t tilesWide,
+        size_t tilesHigh,
+        std::vector<size_t>& changedTiles) const
+    {
+        const size_t largePixelsWide = image.buffer->GetPixelsWide();
+        const size_t largePixelsHigh = image.buffer->GetPixelsHigh();
+
+        // Every surface a ray from the camera can meet is in here.
+        BoundingBox sceneBox;
+        const bool haveSolids = !bvh.IsEmpty();
+        if (haveSolids && !bvh.GetBoundingBox(sceneBox))
+        {
+            return false;
+        }
+
+        std::vector<unsigned char> changed(tilesWide * tilesHigh, 0);
+        for (size_t c=0; c < image.changes.size(); ++c)
+        {
+            const BoundingBox& box = image.changes[c];
+            if (!MarkTilesSeeing(box, largeZoom, largePixelsWide, 
+                    largePixelsHigh, tilesWide, changed))
+            {
+                return false;
+            }
+            if (!haveSolids)
+            {
+                continue;
+            }
+
+            // A sphere round the changed box.
+            const Vector center = 0.5 * (box.minCorner + box.maxCorner);
+            const double radius = (box.maxCorner - center).Magnitude();
+
+            for (size_t l=0; l < lightSourceList.size(); ++l)
+            {
+                // The surfaces whose view of this light the change might
+                // alter lie in the sphere, or in the cone from the light
+                // that just encloses it, beyond the circle where the 
+                // cone touches it, and no further from the light than 
+                // the farthest corner of the scene.  Boxes round the
+                // sphere and round slices of the cone, each spanning 
+                // the circles across the cone at its ends, hold them
+                // all; a long cone is sliced so that these boxes follow
+                // it closely.
+                const Vector& light = lightSourceList[l].location;
+                const Vector axis = center - light;
+                const double distance = axis.Magnitude();
+                if (distance <= radius)
+                {
+                    if (!MarkTilesSeeing(sceneBox, largeZoom, largePixelsWide, 
+                            largePixelsHigh, tilesWide, changed))
+                    {
+                        return false;
+                    }
+                    continue;
+                }
+
+                double reach = 0.0;
+                for (int corner=0; corner < 8; ++corner)
+                {
+                    const Vector v(
+                        (corner & 1) ? sceneBox.maxCorner.x : sceneBox.minCorner.x,
+                        (corner & 2) ? sceneBox.maxCorner.y : sceneBox.minCorner.y,
+                        (corner & 4) ? sceneBox.maxCorner.z : sceneBox.minCorner.z);
+                    reach = std::max(reach, (v - light).Magnitude());
+                }
+
+                // The distances along the axis from the light to the 
+                // circle where the cone touches the sphere, and to the
+                // end of the cone; and the radius of the cone for each
+                // unit of distance along the axis.
+                const double sine = radius / distance;
+                const double touch = distance * (1.0 - sine*sine);
+                const double spread = sine / sqrt(1.0 - sine*sine);
+                const Vector direction = axis / distance;
+                const int slices = (reach <= touch) ? 0 : std::min(
+                    MAX_SHADOW_SLICES, 
+                    1 + static_cast<int>((reach - touch) / (2.0 * radius)));
+                const Vector extent(radius, radius, radius);
+                BoundingBox slice(center - extent, center + extent);
+                for (int k=1; k <= slices; ++k)
+                {
+                    const double along = touch + (reach - touch) * k / slices;
+                    const Vector middle = light + along * direction;
+                    const Vector width(
+                        along * spread, along * spread, along * spread);
+                    const BoundingBox end(middle - width, middle + width);
+                    slice.Include(end);
+                    if (!MarkTilesSeeingPart(slice, sceneBox, largeZoom, 
+                            largePixelsWide, largePixelsHigh, tilesWide, changed))
+                    {
+                        return false;
+                    }
+                    slice = end;
+                }
+                if (slices == 0 &&
+                    !MarkTilesSeeingPart(slice, sceneBox, largeZoom, 
+                        largePixelsWide, largePixelsHigh, tilesWide, changed))
                 {
-                    // We found a surface that is definitely blocking
-                    // the line of sight.  No need to keep looking!
                     return false;
                 }
             }
         }
 
-        // We would not find any solid object that blocks the line of sight.
-        return true;  
+        changedTiles.clear();
+        for (size_t t=0; t < changed.size(); ++t)
+        {
+            if (changed[t])
+            {
+                changedTiles.push_back(t);
+            }
+        }
+        return true;
     }
 
     // Generate an image of the scene and write it to the 
@@ -721,7 +1500,8 @@ namespace Imager
     // to make smoother (less jagged) looking images.
     // Generally, antiAliasFactor should be between 1 (fastest, but jagged)
     // and 4 (16 times slower, but very smooth looking).
-    // KB -- modified to write to framebuffer
+    // KB -- modified to write to framebuffer, and to trace in tiles
+    // on the thread pool, if there is one
     void Scene::SaveImage(
 	FrameBuffer *fb,
         size_t pixelsWide, 
@@ -739,84 +1519,137 @@ namespace Imager
             ((pixelsWide < pixelsHigh) ? pixelsWide : pixelsHigh);
 
         const double largeZoom  = antiAliasFactor * zoom * smallerDim;
-        ImageBuffer buffer(largePixelsWide, largePixelsHigh, backgroundColor);
-
-        // The camera is located at the origin.
-        Vector camera(0.0, 0.0, 0.0);
-
-        // The camera faces in the -z direction.
-        // This allows the +x direction to be to the right,
-        // and the +y direction to be upward.
-        Vector direction(0.0, 0.0, -1);
-
-        const Color fullIntensity(1.0, 1.0, 1.0);
-
-        // We keep a list of (i,j) screen coordinates for pixels
-        // we are not able to trace definitive rays for.
-        // Later we will come back and fix these pixels.
-        PixelList ambiguousPixelList;
 
-        for (size_t i=0; i < largePixelsWide; ++i)
+        // The hierarchy is only built again if solids have been added,
+        // shown, hidden, or moved since it was last built.
+        std::chrono::steady_clock::time_point stageStart = 
+            std::chrono::steady_clock::now();
+        const unsigned long layoutSerial = SolidObject::GetLayoutSerial();
+        if (bvhStale || layoutSerial != bvhLayoutSerial)
         {
-            direction.x = (i - largePixelsWide/2.0) / largeZoom;
-            for (size_t j=0; j < largePixelsHigh; ++j)
-            {
-                direction.y = (largePixelsHigh/2.0 - j) / largeZoom;
+            bvh.Build(solidObjectList);
+            bvhStale = false;
+            bvhLayoutSerial = layoutSerial;
+        }
+        renderSerial = nextRenderSerial++;
+        renderTimes.bvhBuild = MillisecondsSince(stageStart);
+        stageStart = std::chrono::steady_clock::now();
+
+        // If nothing in the scene reflects light or lets it through,
+        // no ray from the camera ever branches.
+        bool opaqueMatte = true;
+        for (size_t i=0; i < solidObjectList.size() && opaqueMatte; ++i)
+        {
+            const SolidObject* solid = solidObjectList[i];
+            opaqueMatte = !solid->IsVisible() || solid->IsOpaqueMatte();
+        }
 
+        // Debug points work through the shared activeDebugPoint,
+        // so can only be used when rendering on one thread, and
+        // one ray at a time, by the general path, which reports
+        // on each step.
+        int workers = (pool != NULL) ? pool->get_threads() : 1;
+        int packetWidth = bvh.GetPacketWidth();
 #if RAYTRACE_DEBUG_POINTS
-                {
-                    using namespace std;
-
-                    // Assume no active debug point unless we find one below.
-                    activeDebugPoint = NULL;    
-
-                    DebugPointList::const_iterator iter = debugPointList.begin();
-                    DebugPointList::const_iterator end  = debugPointList.end();
-                    for(; iter != end; ++iter)
-                    {
-                        if ((iter->iPixel == i) && (iter->jPixel == j))
-                        {
-                            cout << endl;
-                            cout << "Hit breakpoint at (";
-                            cout << i << ", " << j <<")" << endl;
-                            activeDebugPoint = &(*iter);
-                            break;
-                        }
-                    }
-                }
+        workers = 1;
+        packetWidth = 0;
+        opaqueMatte = false;
 #endif
 
-                PixelData& pixel = buffer.Pixel(i,j);
-                try
-                {
-                    // Trace a ray from the camera toward the given direction
-                    // to figure out what color to assign to this pixel.
-                    pixel.color = TraceRay(
-                        camera,
-                        direction,
-                        ambientRefraction,
-                        fullIntensity,
-                        0);
-                }
-                catch (AmbiguousIntersectionException)
-                {
-                    // Getting here means that somewhere in the recursive 
-                    // code for tracing rays, there were multiple 
-                    // intersections that had minimum distance from a 
-                    // vantage point.  This can be really bad, 
-                    // for example causing a ray of light to reflect 
-                    // inward into a solid.
-
-                    // Mark the pixel as ambiguous, so that any other
-                    // ambiguous pixels nearby know not to use it.
-                    pixel.isAmbiguous = true;
-
-                    // Keep a list of all ambiguous pixel coordinates
-                    // so that we can rapidly enumerate through them
-                    // in the disambiguation pass.
-                    ambiguousPixelList.push_back(PixelCoordinates(i, j));
-                }
+        const size_t tilesWide = (largePixelsWide + TILE_SIZE - 1) / TILE_SIZE;
+        const size_t tilesHigh = (largePixelsHigh + TILE_SIZE - 1) / TILE_SIZE;
+
+        // Adaptive anti-aliasing takes two passes: one ray for each
+        // pixel, then all the rest for the pixels that need them.
+        const bool adaptive = adaptiveAntiAliasing && (antiAliasFactor > 1);
+
+        // If the caller keeps the image from one call to the next, and
+        // no pixel's color depends on more than the one ray from the 
+        // camera and its shadow rays, only the tiles that the changes 
+        // can have altered need tracing again.  Otherwise the image is
+        // traced into a buffer of its own, in full.
+        std::unique_ptr<ImageBuffer> ownBuffer;
+        ImageBuffer* bufferPointer;
+        std::vector<size_t> changedTiles;
+        bool traceAll = true;
+        if (incrementalImage != NULL && opaqueMatte && !adaptive)
+        {
+            IncrementalImage& image = *incrementalImage;
+            if (image.buffer != NULL &&
+                image.buffer->GetPixelsWide() == largePixelsWide &&
+                image.buffer->GetPixelsHigh() == largePixelsHigh &&
+                image.zoom == zoom &&
+                image.antiAliasFactor == antiAliasFactor)
+            {
+                traceAll = !FindChangedTiles(
+                    image, largeZoom, tilesWide, tilesHigh, changedTiles);
+            }
+            else
+            {
+                delete image.buffer;
+                image.buffer = NULL;
+                image.buffer = new ImageBuffer(
+                    largePixelsWide, largePixelsHigh, backgroundColor);
+                image.zoom = zoom;
+                image.antiAliasFactor = antiAliasFactor;
+            }
+            image.changes.clear();
+            bufferPointer = image.buffer;
+        }
+        else
+        {
+            if (incrementalImage != NULL)
+            {
+                incrementalImage->Reset();
             }
+            ownBuffer.reset(new ImageBuffer(
+                largePixelsWide, largePixelsHigh, backgroundColor));
+            bufferPointer = ownBuffer.get();
+        }
+        ImageBuffer& buffer = *bufferPointer;
+        tileCount = tilesWide * tilesHigh;
+        tracedTileCount = traceAll ? tileCount : changedTiles.size();
+
+        RenderJob job;
+        job.scene = this;
+        job.buffer = &buffer;
+        job.tilesWide = tilesWide;
+        job.largeZoom = largeZoom;
+        job.tileList = traceAll ? NULL : &changedTiles;
+        job.packetWidth = packetWidth;
+        job.opaqueMatte = opaqueMatte;
+        job.antiAliasFactor = antiAliasFactor;
+        job.pixelsWide = pixelsWide;
+        job.ambiguousPixelLists.resize(workers);
+        job.failure = NULL;
+        job.rayCounters.resize(workers);
+
+        job.samples = adaptive ? SAMPLE_CENTERS : SAMPLE_ALL;
+        refinedPixelCount = pixelsWide * pixelsHigh;
+        for (;;)
+        {
+            TileQueue tiles(tracedTileCount, workers);
+            job.tiles = &tiles;
+            if (workers > 1)
+            {
+                pool->run(RenderTiles, &job);
+            }
+            else
+            {
+                RenderTiles(0, 1, &job);
+            }
+
+            if (job.samples != SAMPLE_CENTERS || job.failure != NULL)
+            {
+                break;
+            }
+            refinedPixelCount = FindEdgePixels(buffer, job);
+            job.samples = SAMPLE_REFINED;
+        }
+
+        if (adaptive && job.failure == NULL)
+        {
+            FillSmoothPixels(buffer, job);
         }
 
 #if RAYTRACE_DEBUG_POINTS
@@ -824,15 +1657,61 @@ namespace Imager
         activeDebugPoint = NULL;
 #endif
 
+        renderTimes.trace = MillisecondsSince(stageStart);
+        stageStart = std::chrono::steady_clock::now();
+
+        rayCounters = RayCounters();
+        for (int w=0; w < workers; ++w)
+        {
+            rayCounters += job.rayCounters[w];
+        }
+
+        if (job.failure != NULL)
+        {
+            // Some tiles may be only part traced.
+            if (ownBuffer == NULL)
+            {
+                incrementalImage->Reset();
+            }
+            throw ImagerException(job.failure);
+        }
+
         // Go back and "heal" ambiguous pixels as best we can.
-        PixelList::const_iterator iter = ambiguousPixelList.begin();
-        PixelList::const_iterator end  = ambiguousPixelList.end();
-        for (; iter != end; ++iter)
+        // Healing a pixel uses only its unambiguous neighbours, so
+        // the order in which the workers found them does not matter.
+        // Pixels kept from the last image may have new neighbours, so
+        // all the ambiguous pixels of a kept image are healed again.
+        ambiguousPixelCount = 0;
+        if (ownBuffer == NULL)
         {
-            const PixelCoordinates& p = *iter;
-            ResolveAmbiguousPixel(buffer, p.i, p.j);
+            for (size_t j=0; j < largePixelsHigh; ++j)
+            {
+                for (size_t i=0; i < largePixelsWide; ++i)
+                {
+                    if (buffer.Pixel(i, j).isAmbiguous)
+                    {
+                        ResolveAmbiguousPixel(buffer, i, j);
+                        ++ambiguousPixelCount;
+                    }
+                }
+            }
+        }
+        for (int w=0; w < workers && ownBuffer != NULL; ++w)
+        {
+            const PixelList& ambiguousPixelList = job.ambiguousPixelLists[w];
+            ambiguousPixelCount += ambiguousPixelList.size();
+            PixelList::const_iterator iter = ambiguousPixelList.begin();
+            PixelList::const_iterator end  = ambiguousPixelList.end();
+            for (; iter != end; ++iter)
+            {
+                const PixelCoordinates& p = *iter;
+                ResolveAmbiguousPixel(buffer, p.i, p.j);
+            }
         }
 
+        renderTimes.heal = MillisecondsSince(stageStart);
+        stageStart = std::chrono::steady_clock::now();
+
         // We want to scale the arbitrary range of
         // color component values to the range 0..255
         // allowed by PNG format.  We therefore find
@@ -840,6 +1719,13 @@ namespace Imager
         // in the image.
         const double max = buffer.MaxColorValue();
 
+        renderTimes.maxColor = MillisecondsSince(stageStart);
+        stageStart = std::chrono::steady_clock::now();
+
+        // KB -- Average the samples into pixels first, and then write
+        // them all to the framebuffer, so that each can be timed.
+        downsampled.resize(3 * pixelsWide * pixelsHigh);
+        unsigned char* rgb = downsampled.data();
         const double patchSize = antiAliasFactor * antiAliasFactor;
         for (size_t j=0; j < pixelsHigh; ++j)
         {
@@ -857,12 +1743,26 @@ namespace Imager
                 }
                 sum /= patchSize;
 
-            framebuffer_set_pixel (fb, i + xoff, j + yoff,  
-                ConvertPixelValue(sum.red,   max),
-                ConvertPixelValue(sum.green, max),
-                ConvertPixelValue(sum.blue,  max));
+                *rgb++ = ConvertPixelValue(sum.red,   max);
+                *rgb++ = ConvertPixelValue(sum.green, max);
+                *rgb++ = ConvertPixelValue(sum.blue,  max);
+            }
+        }
+
+        renderTimes.downsample = MillisecondsSince(stageStart);
+        stageStart = std::chrono::steady_clock::now();
+
+        rgb = downsampled.data();
+        for (size_t j=0; j < pixelsHigh; ++j)
+        {
+            for (size_t i=0; i < pixelsWide; ++i, rgb += 3)
+            {
+                framebuffer_set_pixel (fb, i + xoff, j + yoff,  
+                    rgb[0], rgb[1], rgb[2]);
             }
         }
+
+        renderTimes.blit = MillisecondsSince(stageStart);
  
     // KB -- PNG stuff removed
     }
@@ -881,7 +1781,7 @@ namespace Imager
         for (; iter != end; ++iter)
         {
             const SolidObject* solid = *iter;
-            if (solid->Contains(point))
+            if (solid->IsVisible() && solid->Contains(point))    // KB
             {
                 return solid;
             }
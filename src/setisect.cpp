@@ -41,13 +41,14 @@ namespace Imager
     {
         // Find all the intersections of aSolid with the ray emanating 
         // from the vantage point.
-        tempIntersectionList.clear();
-        aSolid.AppendAllIntersections(vantage, direction, tempIntersectionList);
+        ScratchIntersectionList scratch;
+        const IntersectionList& aList = scratch.List();
+        aSolid.AppendAllIntersections(vantage, direction, scratch.List());
 
         // For each intersection, append to intersectionList 
         // if the point is inside bSolid.
-        IntersectionList::const_iterator iter = tempIntersectionList.begin();
-        IntersectionList::const_iterator end  = tempIntersectionList.end();
+        IntersectionList::const_iterator iter = aList.begin();
+        IntersectionList::const_iterator end  = aList.end();
         for (; iter != end; ++iter)
         {
             if (bSolid.Contains(iter->point))
@@ -76,12 +77,13 @@ namespace Imager
         const SolidObject&  bSolid) const
     {
         // Find all the intersections of aSolid with the ray emanating from vantage.
-        tempIntersectionList.clear();
-        aSolid.AppendAllIntersections(vantage, direction, tempIntersectionList);
+        ScratchIntersectionList scratch;
+        const IntersectionList& aList = scratch.List();
+        aSolid.AppendAllIntersections(vantage, direction, scratch.List());
 
         // Iterate through all the intersections we found with aSolid.
-        IntersectionList::const_iterator iter = tempIntersectionList.begin();
-        IntersectionList::const_iterator end  = tempIntersectionList.end();
+        IntersectionList::const_iterator iter = aList.begin();
+        IntersectionList::const_iterator end  = aList.end();
         for (; iter != end; ++iter)
         {
             // If bSolid contains any of the intersections with aSolid, then
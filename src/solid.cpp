@@ -26,10 +26,58 @@
     Contains common code for base class SolidObject.
 */
 
+#include <atomic>
 #include "imager.h"
 
 namespace Imager
 {
+    namespace
+    {
+        // The scratch lists belonging to one thread.  The first 'depth'
+        // of them are on loan.
+        struct ScratchPool
+        {
+            std::vector<IntersectionList*> lists;
+            size_t depth;
+
+            ScratchPool()
+                : depth(0)
+            {
+            }
+
+            ~ScratchPool()
+            {
+                for (size_t i=0; i < lists.size(); ++i)
+                {
+                    delete lists[i];
+                }
+            }
+
+            IntersectionList& Borrow()
+            {
+                if (depth == lists.size())
+                {
+                    lists.push_back(new IntersectionList);
+                }
+                IntersectionList& list = *lists[depth++];
+                list.clear();
+                return list;
+            }
+        };
+
+        thread_local ScratchPool scratchPool;
+    }
+
+    ScratchIntersectionList::ScratchIntersectionList()
+        : list(scratchPool.Borrow())
+    {
+    }
+
+    ScratchIntersectionList::~ScratchIntersectionList()
+    {
+        --scratchPool.depth;
+    }
+
     bool SolidObject::Contains(const Vector& point) const
     {
         // FIXFIXFIX:  This function does not handle the "corner case":
@@ -44,8 +92,9 @@ namespace Imager
             // of times we enter and exit this solid.
             const Vector direction(0.0, 0.0, 1.0);
 
-            enclosureList.clear();
-            AppendAllIntersections(point, direction, enclosureList);
+            ScratchIntersectionList scratch;
+            const IntersectionList& enclosureList = scratch.List();
+            AppendAllIntersections(point, direction, scratch.List());
 
             int enterCount = 0;     // number of times we enter the solid
             int exitCount  = 0;     // number of times we exit the solid
@@ -110,4 +159,18 @@ namespace Imager
             return false;
         }
     }
+
+    // KB -- The layout serial is shared by every scene, which may be
+    // rendered on different threads.
+    static std::atomic<unsigned long> layoutSerial(0);
+
+    unsigned long SolidObject::GetLayoutSerial()
+    {
+        return layoutSerial;
+    }
+
+    void SolidObject::LayoutChanged()
+    {
+        ++layoutSerial;
+    }
 }
@@ -48,6 +48,7 @@ namespace Imager
         // Calculate the radicand of the quadratic equation solution formula.
         // The radicand must be non-negative for there to be real solutions.
         const double radicand = b*b - 4.0*a*c;
+        RAYTRACE_COUNT(sphereTests, 1);
         if (radicand >= 0.0)
         {
             // There are two intersection solutions, one involving 
@@ -62,6 +63,7 @@ namespace Imager
                 (-b - root) / denom
             };
 
+            bool hit = false;
             for (int i=0; i < 2; ++i)
             {
                 if (u[i] > EPSILON)
@@ -80,8 +82,50 @@ namespace Imager
 
                     intersection.solid = this;
                     intersectionList.push_back(intersection);
+                    hit = true;
                 }
             }
+            if (hit)
+            {
+                RAYTRACE_COUNT(sphereHits, 1);
+            }
+        }
+    }
+
+    // KB -- The same calculation as AppendAllIntersections, but
+    // stopping as soon as it finds an intersection closer than 
+    // vantage + direction.
+    bool Sphere::HasIntersectionBefore(
+        const Vector& vantage, 
+        const Vector& direction) const
+    {
+        const Vector displacement = vantage - Center();
+        const double a = direction.MagnitudeSquared();
+        const double b = 2.0 * DotProduct(direction, displacement);
+        const double c = displacement.MagnitudeSquared() - radius*radius;
+        const double radicand = b*b - 4.0*a*c;
+        RAYTRACE_COUNT(sphereTests, 1);
+        if (radicand < 0.0)
+        {
+            return false;
+        }
+
+        const double root = sqrt(radicand);
+        const double denom = 2.0 * a;
+        const double u[2] = {
+            (-b + root) / denom,
+            (-b - root) / denom
+        };
+
+        for (int i=0; i < 2; ++i)
+        {
+            if (u[i] > EPSILON && 
+                (u[i] * direction).MagnitudeSquared() < a)
+            {
+                RAYTRACE_COUNT(sphereHits, 1);
+                return true;
+            }
         }
+        return false;
     }
 }
@@ -0,0 +1,372 @@
+/*============================================================================
+
+  spherelattice.cpp
+
+  Copyright (c)2021 Kevin Boone, GPL v3.0
+
+  The traversal is the one described by Amanatides and Woo in "A Fast
+  Voxel Traversal Algorithm for Ray Tracing" (Eurographics, 1987).
+
+============================================================================*/
+
+#include <cmath>
+#include "spherelattice.h"
+
+namespace Imager
+{
+    SphereLattice::SphereLattice(
+        const Life3DFrame& _grid,
+        const Vector& _origin,
+        double _spacing,
+        double _radius)
+            : SolidObject(_origin + Vector(
+                _spacing * (_grid.get_size_x() - 1) / 2.0,
+                _spacing * (_grid.get_size_y() - 1) / 2.0,
+                -_spacing * (_grid.get_size_z() - 1) / 2.0))
+            , grid(_grid)
+            , origin(_origin)
+            , spacing(_spacing)
+            , radius(_radius)
+    {
+        // The walk relies on each sphere lying wholly within its cell.
+        if (radius <= 0.0 || 2.0 * radius > spacing)
+        {
+            throw ImagerException("Lattice spheres must fit within their cells.");
+        }
+        SetTag("SphereLattice");
+    }
+
+    void SphereLattice::Walk(
+        const Vector& vantage,
+        const Vector& direction,
+        IntersectionList& intersectionList,
+        bool closestOnly,
+        double uMax) const
+    {
+        const int size[3] =
+        {
+            grid.get_size_x(),
+            grid.get_size_y(),
+            grid.get_size_z()
+        };
+
+        // Work in lattice coordinates, in which cell (x,y,z) is the
+        // unit cube from (x,y,z) to (x+1,y+1,z+1).  A point at parameter
+        // u along the ray is at the same u in both coordinate systems.
+        const double start[3] =
+        {
+            (vantage.x - origin.x) / spacing + 0.5,
+            (vantage.y - origin.y) / spacing + 0.5,
+            (origin.z - vantage.z) / spacing + 0.5
+        };
+        const double dir[3] =
+        {
+            direction.x / spacing,
+            direction.y / spacing,
+            -direction.z / spacing
+        };
+
+        // Find where the ray enters the box that holds the grid, if it
+        // does at all.  It may start inside.
+        double uEnter = 0.0;
+        double uExit  = uMax;
+        for (int a=0; a < 3; ++a)
+        {
+            if (dir[a] == 0.0)
+            {
+                if (start[a] < 0.0 || start[a] >= size[a])
+                {
+                    return;
+                }
+            }
+            else
+            {
+                double u0 = -start[a] / dir[a];
+                double u1 = (size[a] - start[a]) / dir[a];
+                if (u0 > u1)
+                {
+                    const double swap = u0;
+                    u0 = u1;
+                    u1 = swap;
+                }
+                if (u0 > uEnter)
+                {
+                    uEnter = u0;
+                }
+                if (u1 < uExit)
+                {
+                    uExit = u1;
+                }
+            }
+        }
+        if (uEnter >= uExit)
+        {
+            return;
+        }
+
+        // For each axis: the cell the ray is in, which way it moves from
+        // cell to cell, the value of u at which it next crosses a cell
+        // boundary, and the change in u from one boundary to the next.
+        int cell[3];
+        int step[3];
+        double uNext[3];
+        double uDelta[3];
+        for (int a=0; a < 3; ++a)
+        {
+            int c = static_cast<int>(floor(start[a] + uEnter * dir[a]));
+
+            // Rounding can put the entry point just outside the grid.
+            if (c < 0)
+            {
+                c = 0;
+            }
+            else if (c >= size[a])
+            {
+                c = size[a] - 1;
+            }
+            cell[a] = c;
+
+            if (dir[a] > 0.0)
+            {
+                step[a] = 1;
+                uNext[a] = (c + 1 - start[a]) / dir[a];
+                uDelta[a] = 1.0 / dir[a];
+            }
+            else if (dir[a] < 0.0)
+            {
+                step[a] = -1;
+                uNext[a] = (c - start[a]) / dir[a];
+                uDelta[a] = -1.0 / dir[a];
+            }
+            else
+            {
+                step[a] = 0;
+                uNext[a] = HUGE_VAL;
+                uDelta[a] = HUGE_VAL;
+            }
+        }
+
+        for (;;)
+        {
+            const int found = AppendCellIntersections(
+                cell[0], cell[1], cell[2],
+                vantage,
+                direction,
+                intersectionList);
+
+            // No sphere further along can be closer than this one.
+            if (found > 0 && closestOnly)
+            {
+                return;
+            }
+
+            // Move into whichever neighbouring cell the ray reaches first,
+            // and stop when that takes it out of the grid, or past uMax.
+            int a;
+            if (uNext[0] < uNext[1])
+            {
+                a = (uNext[0] < uNext[2]) ? 0 : 2;
+            }
+            else
+            {
+                a = (uNext[1] < uNext[2]) ? 1 : 2;
+            }
+            cell[a] += step[a];
+            if (cell[a] < 0 || cell[a] >= size[a] || uNext[a] > uExit)
+            {
+                return;
+            }
+            uNext[a] += uDelta[a];
+        }
+    }
+
+    int SphereLattice::AppendCellIntersections(
+        int x, int y, int z,
+        const Vector& vantage,
+        const Vector& direction,
+        IntersectionList& intersectionList) const
+    {
+        const int age = grid.get_age(x, y, z);
+        if (age == 0)
+        {
+            return 0;
+        }
+
+        // This is the same calculation as Sphere::AppendAllIntersections.
+        const Vector center = CellCenter(x, y, z);
+        const Vector displacement = vantage - center;
+        const double a = direction.MagnitudeSquared();
+        const double b = 2.0 * DotProduct(direction, displacement);
+        const double c = displacement.MagnitudeSquared() - radius*radius;
+        const double radicand = b*b - 4.0*a*c;
+        RAYTRACE_COUNT(sphereTests, 1);
+        if (radicand < 0.0)
+        {
+            return 0;
+        }
+
+        // The optics for a cell of this age, which SurfaceOptics
+        // gets back through the intersection's context.
+        const Optics* optics = NULL;
+        if (!ageOptics.empty())
+        {
+            const size_t index = static_cast<size_t>(age) - 1;
+            optics = &ageOptics[(index < ageOptics.size()) ?
+                index : ageOptics.size() - 1];
+        }
+
+        const double root = sqrt(radicand);
+        const double denom = 2.0 * a;
+        const double u[2] = {
+            (-b + root) / denom,
+            (-b - root) / denom
+        };
+
+        int found = 0;
+        for (int i=0; i < 2; ++i)
+        {
+            if (u[i] > EPSILON)
+            {
+                Intersection intersection;
+                const Vector vantageToSurface = u[i] * direction;
+                intersection.point = vantage + vantageToSurface;
+                intersection.surfaceNormal =
+                    (intersection.point - center).UnitVector();
+                intersection.distanceSquared =
+                    vantageToSurface.MagnitudeSquared();
+                intersection.solid = this;
+                intersection.context = optics;
+                intersectionList.push_back(intersection);
+                ++found;
+            }
+        }
+        if (found > 0)
+        {
+            RAYTRACE_COUNT(sphereHits, 1);
+        }
+        return found;
+    }
+
+    bool SphereLattice::HasIntersectionBefore(
+        const Vector& vantage,
+        const Vector& direction) const
+    {
+        // Only the first sphere the ray hits matters, and
+        // only cells that the ray reaches before u = 1.
+        ScratchIntersectionList scratch;
+        Walk(vantage, direction, scratch.List(), true, 1.0);
+        const double gapDistanceSquared = direction.MagnitudeSquared();
+        for (size_t i=0; i < scratch.List().size(); ++i)
+        {
+            if (scratch.List()[i].distanceSquared < gapDistanceSquared)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool SphereLattice::Contains(const Vector& point) const
+    {
+        // The only sphere that can contain the point is the one in
+        // the cell it lies in.
+        const int x = static_cast<int>(floor((point.x - origin.x) / spacing + 0.5));
+        const int y = static_cast<int>(floor((point.y - origin.y) / spacing + 0.5));
+        const int z = static_cast<int>(floor((origin.z - point.z) / spacing + 0.5));
+        if (x < 0 || x >= grid.get_size_x() ||
+            y < 0 || y >= grid.get_size_y() ||
+            z < 0 || z >= grid.get_size_z() ||
+            !grid.is_alive(x, y, z))
+        {
+            return false;
+        }
+
+        // As Sphere::Contains, with a little tolerance for rounding.
+        const double r = radius + EPSILON;
+        return (point - CellCenter(x, y, z)).MagnitudeSquared() <= (r * r);
+    }
+
+    bool SphereLattice::GetBoundingBox(BoundingBox& box) const
+    {
+        // The spheres of the corner cells, whether alive or not.  Cells
+        // further into the grid have lower z, so the cell with the
+        // smallest coordinates is (0, 0, NZ-1), and the one with the 
+        // largest is (NX-1, NY-1, 0).
+        const Vector extent(radius, radius, radius);
+        const Vector minCornerCell = CellCenter(0, 0, grid.get_size_z() - 1);
+        const Vector maxCornerCell = CellCenter(
+            grid.get_size_x() - 1,
+            grid.get_size_y() - 1,
+            0);
+        box = BoundingBox(
+            minCornerCell - extent,
+            maxCornerCell + extent);
+        return true;
+    }
+
+    Optics SphereLattice::SurfaceOptics(
+        const Vector& surfacePoint,
+        const void *context) const
+    {
+        if (context != NULL)
+        {
+            return *static_cast<const Optics*>(context);
+        }
+        return GetUniformOptics();
+    }
+
+    bool SphereLattice::IsOpaqueMatte() const
+    {
+        if (ageOptics.empty())
+        {
+            return GetUniformOptics().IsOpaqueMatte();
+        }
+        for (size_t i=0; i < ageOptics.size(); ++i)
+        {
+            if (!ageOptics[i].IsOpaqueMatte())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void SphereLattice::SetAgeOptics(int age, const Optics& optics)
+    {
+        if (age < 1)
+        {
+            throw ImagerException("Cell age must be at least 1.");
+        }
+
+        // Any younger ages not yet set are given the same optics.
+        if (ageOptics.size() < static_cast<size_t>(age))
+        {
+            ageOptics.resize(age, optics);
+        }
+        ageOptics[age - 1] = optics;
+    }
+
+    SolidObject& SphereLattice::Translate(double dx, double dy, double dz)
+    {
+        SolidObject::Translate(dx, dy, dz);
+        origin.x += dx;
+        origin.y += dy;
+        origin.z += dz;
+        return *this;
+    }
+
+    SolidObject& SphereLattice::RotateX(double angleInDegrees)
+    {
+        throw ImagerException("A SphereLattice cannot be rotated.");
+    }
+
+    SolidObject& SphereLattice::RotateY(double angleInDegrees)
+    {
+        throw ImagerException("A SphereLattice cannot be rotated.");
+    }
+
+    SolidObject& SphereLattice::RotateZ(double angleInDegrees)
+    {
+        throw ImagerException("A SphereLattice cannot be rotated.");
+    }
+}
@@ -0,0 +1,122 @@
+/*============================================================================
+
+  spherelattice.h
+
+  Copyright (c)2021 Kevin Boone, GPL v3.0
+
+  A SolidObject for the ray tracer that draws a whole Life3D grid, as
+  captured in a Life3DFrame: a sphere at the centre of every live 
+  cell. Rather than testing each ray against every sphere, it steps 
+  the ray through the cells of the grid in the order the ray meets 
+  them (a 3D digital differential analyser, or DDA), and tests only 
+  the sphere in each live cell it passes through. Because each sphere
+  lies wholly within its own cell, the first sphere hit is the 
+  closest, and the search can stop there. So the cost of a ray 
+  depends on the size of the grid along the ray, rather than on the
+  number of live cells.
+
+============================================================================*/
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include "imager.h"
+#include "life3d.h"
+
+namespace Imager
+{
+    class SphereLattice: public SolidObject
+    {
+    public:
+        // Spheres of the given radius sit at the centres of the cells
+        // of 'grid', 'spacing' apart, with the centre of cell (0,0,0)
+        // at 'origin'. The grid's x and y axes run along the scene's
+        // +x and +y axes, and its z axis along -z, away from the camera.
+        // The radius may be at most half the spacing. The frame must
+        // outlive this object, and must not change during rendering.
+        SphereLattice(
+            const Life3DFrame& _grid,
+            const Vector& _origin,
+            double _spacing,
+            double _radius);
+
+        virtual void AppendAllIntersections(
+            const Vector& vantage,
+            const Vector& direction,
+            IntersectionList& intersectionList) const
+        {
+            Walk(vantage, direction, intersectionList, false, HUGE_VAL);
+        }
+
+        virtual void AppendClosestIntersections(
+            const Vector& vantage,
+            const Vector& direction,
+            IntersectionList& intersectionList) const
+        {
+            Walk(vantage, direction, intersectionList, true, HUGE_VAL);
+        }
+
+        virtual bool HasIntersectionBefore(
+            const Vector& vantage,
+            const Vector& direction) const;
+
+        virtual bool Contains(const Vector& point) const;
+
+        virtual bool GetBoundingBox(BoundingBox& box) const;
+
+        virtual Optics SurfaceOptics(
+            const Vector& surfacePoint,
+            const void *context) const;
+
+        virtual bool IsOpaqueMatte() const;
+
+        // Sets the optics of the spheres of cells of the given age,
+        // which must be at least 1. Cells older than the oldest age
+        // that has been set look like the oldest; if no age has been
+        // set, all spheres have the lattice's uniform optics.
+        void SetAgeOptics(int age, const Optics& optics);
+
+        virtual SolidObject& Translate(double dx, double dy, double dz);
+
+        // A lattice is always aligned with the axes.
+        virtual SolidObject& RotateX(double angleInDegrees);
+        virtual SolidObject& RotateY(double angleInDegrees);
+        virtual SolidObject& RotateZ(double angleInDegrees);
+
+    private:
+        // Appends the intersections with the spheres of the cells the
+        // ray passes through, stopping after the first cell with any if
+        // closestOnly is set, and before any cell the ray only reaches
+        // beyond vantage + uMax*direction.
+        void Walk(
+            const Vector& vantage,
+            const Vector& direction,
+            IntersectionList& intersectionList,
+            bool closestOnly,
+            double uMax) const;
+
+        // Appends the intersections with the sphere of the cell at
+        // x, y, z, if it is alive, and returns how many there were.
+        int AppendCellIntersections(
+            int x, int y, int z,
+            const Vector& vantage,
+            const Vector& direction,
+            IntersectionList& intersectionList) const;
+
+        Vector CellCenter(int x, int y, int z) const
+        {
+            return Vector(
+                origin.x + spacing * x,
+                origin.y + spacing * y,
+                origin.z - spacing * z);
+        }
+
+        const Life3DFrame& grid;
+        Vector origin;
+        double spacing;
+        double radius;
+
+        // The optics for each age of cell, from 1 up
+        std::vector<Optics> ageOptics;
+    };
+}
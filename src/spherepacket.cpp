@@ -0,0 +1,372 @@
+/*============================================================================
+
+  spherepacket.cpp
+
+  Copyright (c)2021 Kevin Boone, GPL v3.0
+
+  Tracing of packets of rays from one vantage point through a bounding
+  volume hierarchy that holds only spheres, as they do when each cell
+  of the grid is drawn as a separate Sphere. The spheres' centres and
+  radii are copied out into one array for each coordinate, so each
+  sphere can be tested against all the rays of a packet at once, one
+  ray to each lane of an AVX2 or AVX-512 register. Which of these the
+  processor has is found out at run time; if it has neither, or is not
+  an x86 processor at all, Scene traces one ray at a time, as it does
+  for any other solids. The lanes are always doubles, even though AVX2
+  could test eight rays at once in floats: in single precision, a ray
+  that grazes a sphere may hit or miss it differently.
+
+  A packet only finds which sphere each ray hits first. The exact 
+  intersection is then found by the sphere itself. A ray that meets
+  two spheres at so nearly the same distance that they might tie is 
+  traced again alone, so that the tie is found just as it would be 
+  without packets; so the image is the same whichever way it was
+  traced.
+
+============================================================================*/
+
+#include <cmath>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "imager.h"
+
+namespace Imager
+{
+    // Two intersections whose squared distances from the vantage point
+    // differ by less than this may be a tie, as PickClosestIntersection
+    // sees it.  It is wider than EPSILON, the tolerance that function
+    // uses, because the distances here are worked out a little 
+    // differently, and may be rounded differently; a ray that comes 
+    // near to a tie is traced again alone, which settles it exactly.
+    const double PACKET_TIE_MARGIN = 2.0 * EPSILON;
+
+    // The rays of a packet, one to each lane, and for each ray the
+    // squared distances of the closest and next closest intersections
+    // found so far, with different spheres, and the index into the 
+    // sphere arrays of the closest sphere (-1 for none).  All share the
+    // same vantage point.
+    struct SpherePacket
+    {
+        alignas(64) double dx[BoundingVolumeHierarchy::MAX_PACKET_WIDTH];
+        alignas(64) double dy[BoundingVolumeHierarchy::MAX_PACKET_WIDTH];
+        alignas(64) double dz[BoundingVolumeHierarchy::MAX_PACKET_WIDTH];
+        alignas(64) double a[BoundingVolumeHierarchy::MAX_PACKET_WIDTH];
+        alignas(64) double closestD[BoundingVolumeHierarchy::MAX_PACKET_WIDTH];
+        alignas(64) double nextD[BoundingVolumeHierarchy::MAX_PACKET_WIDTH];
+        alignas(64) double closestIndex[BoundingVolumeHierarchy::MAX_PACKET_WIDTH];
+        Vector vantage;
+    };
+
+    // Tests spheres first..first+count-1 against every ray of the packet.
+    typedef void (*SphereKernel)(
+        SpherePacket& packet,
+        const double* x,
+        const double* y,
+        const double* z,
+        const double* radiusSquared,
+        size_t first,
+        size_t count);
+
+#if defined(__x86_64__) || defined(__i386__)
+    // Each of these is the calculation of Sphere::AppendAllIntersections,
+    // keeping only the closer root in front of the vantage point.  The
+    // quadratic's c term depends only on the sphere, so is worked out 
+    // once for all the rays.  Multiplies and adds are not fused, since
+    // the Sphere code is not; otherwise a ray that only grazes a sphere, 
+    // where the radicand is the small difference of two large numbers,
+    // could get quite a different root.
+
+    __attribute__((target("avx2"), optimize("fp-contract=off")))
+    static void IntersectSpheres4(
+        SpherePacket& packet,
+        const double* x,
+        const double* y,
+        const double* z,
+        const double* radiusSquared,
+        size_t first,
+        size_t count)
+    {
+        const __m256d dx = _mm256_load_pd(packet.dx);
+        const __m256d dy = _mm256_load_pd(packet.dy);
+        const __m256d dz = _mm256_load_pd(packet.dz);
+        const __m256d a  = _mm256_load_pd(packet.a);
+        const __m256d zero = _mm256_setzero_pd();
+        const __m256d two  = _mm256_set1_pd(2.0);
+        const __m256d four = _mm256_set1_pd(4.0);
+        const __m256d epsilon = _mm256_set1_pd(EPSILON);
+        const __m256d denom = _mm256_mul_pd(two, a);
+        __m256d closestD = _mm256_load_pd(packet.closestD);
+        __m256d nextD = _mm256_load_pd(packet.nextD);
+        __m256d closestIndex = _mm256_load_pd(packet.closestIndex);
+
+        for (size_t i=first; i < first+count; ++i)
+        {
+            const double px = packet.vantage.x - x[i];
+            const double py = packet.vantage.y - y[i];
+            const double pz = packet.vantage.z - z[i];
+            const __m256d c = _mm256_set1_pd(px*px + py*py + pz*pz - radiusSquared[i]);
+
+            const __m256d b = _mm256_mul_pd(two, _mm256_add_pd(_mm256_add_pd(
+                _mm256_mul_pd(dx, _mm256_set1_pd(px)),
+                _mm256_mul_pd(dy, _mm256_set1_pd(py))),
+                _mm256_mul_pd(dz, _mm256_set1_pd(pz))));
+            const __m256d radicand = _mm256_sub_pd(
+                _mm256_mul_pd(b, b),
+                _mm256_mul_pd(_mm256_mul_pd(four, a), c));
+            __m256d hit = _mm256_cmp_pd(radicand, zero, _CMP_GE_OQ);
+            if (_mm256_movemask_pd(hit) == 0)
+            {
+                continue;
+            }
+
+            const __m256d root = _mm256_sqrt_pd(_mm256_max_pd(radicand, zero));
+            const __m256d minusB = _mm256_sub_pd(zero, b);
+            const __m256d uNear = _mm256_div_pd(_mm256_sub_pd(minusB, root), denom);
+            const __m256d uFar  = _mm256_div_pd(_mm256_add_pd(minusB, root), denom);
+            const __m256d u = _mm256_blendv_pd(
+                uFar, uNear, _mm256_cmp_pd(uNear, epsilon, _CMP_GT_OQ));
+            hit = _mm256_and_pd(hit, _mm256_cmp_pd(u, epsilon, _CMP_GT_OQ));
+            const __m256d d = _mm256_mul_pd(_mm256_mul_pd(u, u), a);
+
+            // A closer sphere pushes the closest so far into second place.
+            const __m256d closer = _mm256_and_pd(hit, _mm256_cmp_pd(d, closestD, _CMP_LT_OQ));
+            const __m256d second = _mm256_and_pd(hit, _mm256_cmp_pd(d, nextD, _CMP_LT_OQ));
+            nextD = _mm256_blendv_pd(nextD, _mm256_blendv_pd(d, closestD, closer), second);
+            closestD = _mm256_blendv_pd(closestD, d, closer);
+            closestIndex = _mm256_blendv_pd(
+                closestIndex, _mm256_set1_pd(static_cast<double>(i)), closer);
+        }
+
+        _mm256_store_pd(packet.closestD, closestD);
+        _mm256_store_pd(packet.nextD, nextD);
+        _mm256_store_pd(packet.closestIndex, closestIndex);
+    }
+
+    __attribute__((target("avx512f"), optimize("fp-contract=off")))
+    static void IntersectSpheres8(
+        SpherePacket& packet,
+        const double* x,
+        const double* y,
+        const double* z,
+        const double* radiusSquared,
+        size_t first,
+        size_t count)
+    {
+        const __m512d dx = _mm512_load_pd(packet.dx);
+        const __m512d dy = _mm512_load_pd(packet.dy);
+        const __m512d dz = _mm512_load_pd(packet.dz);
+        const __m512d a  = _mm512_load_pd(packet.a);
+        const __m512d zero = _mm512_setzero_pd();
+        const __m512d two  = _mm512_set1_pd(2.0);
+        const __m512d four = _mm512_set1_pd(4.0);
+        const __m512d epsilon = _mm512_set1_pd(EPSILON);
+        const __m512d denom = _mm512_mul_pd(two, a);
+        __m512d closestD = _mm512_load_pd(packet.closestD);
+        __m512d nextD = _mm512_load_pd(packet.nextD);
+        __m512d closestIndex = _mm512_load_pd(packet.closestIndex);
+
+        for (size_t i=first; i < first+count; ++i)
+        {
+            const double px = packet.vantage.x - x[i];
+            const double py = packet.vantage.y - y[i];
+            const double pz = packet.vantage.z - z[i];
+            const __m512d c = _mm512_set1_pd(px*px + py*py + pz*pz - radiusSquared[i]);
+
+            const __m512d b = _mm512_mul_pd(two, _mm512_add_pd(_mm512_add_pd(
+                _mm512_mul_pd(dx, _mm512_set1_pd(px)),
+                _mm512_mul_pd(dy, _mm512_set1_pd(py))),
+                _mm512_mul_pd(dz, _mm512_set1_pd(pz))));
+            const __m512d radicand = _mm512_sub_pd(
+                _mm512_mul_pd(b, b),
+                _mm512_mul_pd(_mm512_mul_pd(four, a), c));
+            __mmask8 hit = _mm512_cmp_pd_mask(radicand, zero, _CMP_GE_OQ);
+            if (hit == 0)
+            {
+                continue;
+            }
+
+            const __m512d root = _mm512_mask_sqrt_pd(zero, hit, radicand);
+            const __m512d minusB = _mm512_sub_pd(zero, b);
+            const __m512d uNear = _mm512_div_pd(_mm512_sub_pd(minusB, root), denom);
+            const __m512d uFar  = _mm512_div_pd(_mm512_add_pd(minusB, root), denom);
+            const __m512d u = _mm512_mask_blend_pd(
+                _mm512_cmp_pd_mask(uNear, epsilon, _CMP_GT_OQ), uFar, uNear);
+            hit &= _mm512_cmp_pd_mask(u, epsilon, _CMP_GT_OQ);
+            const __m512d d = _mm512_mul_pd(_mm512_mul_pd(u, u), a);
+
+            // A closer sphere pushes the closest so far into second place.
+            const __mmask8 closer = hit & _mm512_cmp_pd_mask(d, closestD, _CMP_LT_OQ);
+            const __mmask8 second = hit & _mm512_cmp_pd_mask(d, nextD, _CMP_LT_OQ);
+            nextD = _mm512_mask_blend_pd(second, nextD, 
+                _mm512_mask_blend_pd(closer, d, closestD));
+            closestD = _mm512_mask_blend_pd(closer, closestD, d);
+            closestIndex = _mm512_mask_blend_pd(
+                closer, closestIndex, _mm512_set1_pd(static_cast<double>(i)));
+        }
+
+        _mm512_store_pd(packet.closestD, closestD);
+        _mm512_store_pd(packet.nextD, nextD);
+        _mm512_store_pd(packet.closestIndex, closestIndex);
+    }
+#endif
+
+    // Picks the widest kernel the processor can run, and sets 'width'
+    // to the number of rays it takes, or to zero if there is none.
+    static SphereKernel PickSphereKernel(int& width)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            width = 8;
+            return IntersectSpheres8;
+        }
+        if (__builtin_cpu_supports("avx2"))
+        {
+            width = 4;
+            return IntersectSpheres4;
+        }
+#endif
+        width = 0;
+        return NULL;
+    }
+
+    static int sphereKernelWidth = 0;
+    static const SphereKernel sphereKernel = PickSphereKernel(sphereKernelWidth);
+
+    void BoundingVolumeHierarchy::BuildSphereArrays()
+    {
+        sphereX.clear();
+        sphereY.clear();
+        sphereZ.clear();
+        sphereRadiusSquared.clear();
+        packetWidth = 0;
+
+        if (sphereKernel == NULL || !unboundedList.empty() || solidList.empty())
+        {
+            return;
+        }
+
+        sphereX.reserve(solidList.size());
+        sphereY.reserve(solidList.size());
+        sphereZ.reserve(solidList.size());
+        sphereRadiusSquared.reserve(solidList.size());
+        for (size_t i=0; i < solidList.size(); ++i)
+        {
+            const Sphere* sphere = dynamic_cast<const Sphere*>(solidList[i]);
+            if (sphere == NULL)
+            {
+                sphereX.clear();
+                sphereY.clear();
+                sphereZ.clear();
+                sphereRadiusSquared.clear();
+                return;
+            }
+            sphereX.push_back(sphere->Center().x);
+            sphereY.push_back(sphere->Center().y);
+            sphereZ.push_back(sphere->Center().z);
+            sphereRadiusSquared.push_back(sphere->GetRadius() * sphere->GetRadius());
+        }
+        packetWidth = sphereKernelWidth;
+    }
+
+    void BoundingVolumeHierarchy::FindClosestSpheres(
+        const Vector& vantage,
+        const Vector* directions,
+        int count,
+        const SolidObject** closest,
+        bool* tied) const
+    {
+        SpherePacket packet;
+        packet.vantage = vantage;
+
+        // For each ray, the value of u past which it can meet nothing 
+        // that is closer than its closest sphere so far, or near enough
+        // to tie with it.
+        double uLimit[MAX_PACKET_WIDTH];
+        for (int k=0; k < packetWidth; ++k)
+        {
+            // Any lanes left over repeat the last ray, and their
+            // answers are not used.
+            const Vector& direction = directions[(k < count) ? k : count - 1];
+            packet.dx[k] = direction.x;
+            packet.dy[k] = direction.y;
+            packet.dz[k] = direction.z;
+            packet.a[k] = direction.MagnitudeSquared();
+            packet.closestD[k] = HUGE_VAL;
+            packet.nextD[k] = HUGE_VAL;
+            packet.closestIndex[k] = -1.0;
+            uLimit[k] = HUGE_VAL;
+        }
+
+        size_t stack[BVH_MAX_DEPTH];
+        int depth = 0;
+        stack[depth++] = 0;
+        while (depth > 0)
+        {
+            const Node& node = nodes[stack[--depth]];
+
+            // The node is worth visiting if any ray enters its box
+            // before the closest sphere that ray has found so far, or
+            // near enough to it to hold a tie.
+            bool visit = false;
+            for (int k=0; k < count && !visit; ++k)
+            {
+                double uEnter;
+                visit = node.box.IntersectsRay(
+                    vantage, directions[k], uLimit[k], uEnter);
+            }
+            if (!visit)
+            {
+                continue;
+            }
+
+            if (node.solidCount > 0)
+            {
+                // Only the closest sphere each ray meets is known, and
+                // that is tested again alone, so no hits are counted here.
+                RAYTRACE_COUNT(sphereTests, count * node.solidCount);
+                sphereKernel(
+                    packet,
+                    &sphereX[0],
+                    &sphereY[0],
+                    &sphereZ[0],
+                    &sphereRadiusSquared[0],
+                    node.firstSolid,
+                    node.solidCount);
+                for (int k=0; k < count; ++k)
+                {
+                    uLimit[k] = sqrt(
+                        (packet.closestD[k] + PACKET_TIE_MARGIN) / packet.a[k]);
+                }
+            }
+            else
+            {
+                // The rays of a packet mostly go the same way, so take
+                // the order of the children from the first.
+                const size_t firstChild = (&node - &nodes[0]) + 1;
+                const double d = (node.axis == 0) ? directions[0].x :
+                    ((node.axis == 1) ? directions[0].y : directions[0].z);
+                if (d >= 0.0)
+                {
+                    stack[depth++] = node.secondChild;
+                    stack[depth++] = firstChild;
+                }
+                else
+                {
+                    stack[depth++] = firstChild;
+                    stack[depth++] = node.secondChild;
+                }
+            }
+        }
+
+        for (int k=0; k < count; ++k)
+        {
+            closest[k] = (packet.closestIndex[k] < 0.0) ? NULL :
+                solidList[static_cast<size_t>(packet.closestIndex[k])];
+            tied[k] = 
+                (packet.nextD[k] - packet.closestD[k] < PACKET_TIE_MARGIN);
+        }
+    }
+}
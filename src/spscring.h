@@ -0,0 +1,129 @@
+/*============================================================================
+
+  spscring.h
+
+  Copyright (c)2021 Kevin Boone, GPL v3.0
+
+  A fixed-size ring of slots, passed from one producer thread to one
+  consumer thread. The slots are made once, with the ring, and filled 
+  in place, so a slot that holds (say) a vector can be refilled without
+  allocating memory once it has grown to size.
+
+  The producer calls begin_push() for an empty slot, fills it, and
+  then calls end_push() to hand it over; the consumer calls front() for
+  the oldest full slot, uses it, and then calls pop() to hand it back.
+  begin_push() and front() return at once, with NULL if there is no 
+  slot to be had; wait_push() and wait_front() instead sleep until 
+  there is one. The slots themselves change hands without any lock; 
+  a mutex is taken only to sleep, and to wake a thread that may be 
+  sleeping.
+
+============================================================================*/
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+#include <atomic>
+
+template <typename T, size_t N>
+class SpscRing
+  {
+  public:
+
+  SpscRing (void) 
+    { 
+    head = 0; 
+    tail = 0; 
+    pthread_mutex_init (&lock, NULL);
+    pthread_cond_init (&moved, NULL);
+    }
+
+  ~SpscRing (void)
+    {
+    pthread_cond_destroy (&moved);
+    pthread_mutex_destroy (&lock);
+    }
+
+  /** The slot to fill next, or NULL if every slot is full. Producer
+      only. */
+  T *begin_push (void)
+    {
+    size_t t = tail.load (std::memory_order_relaxed);
+    if (t - head.load (std::memory_order_acquire) == N) return NULL;
+    return &slots[t % N];
+    }
+
+  /** As begin_push(), but sleeps until there is a slot to fill. 
+      Producer only. */
+  T *wait_push (void)
+    {
+    T *slot = begin_push();
+    if (slot) return slot;
+    pthread_mutex_lock (&lock);
+    while ((slot = begin_push()) == NULL)
+      pthread_cond_wait (&moved, &lock);
+    pthread_mutex_unlock (&lock);
+    return slot;
+    }
+
+  /** Pass the slot from begin_push() to the consumer. Producer only. */
+  void end_push (void)
+    {
+    tail.store (tail.load (std::memory_order_relaxed) + 1,
+      std::memory_order_release);
+    wake();
+    }
+
+  /** The oldest full slot, or NULL if there is none. Consumer only. */
+  T *front (void)
+    {
+    size_t h = head.load (std::memory_order_relaxed);
+    if (tail.load (std::memory_order_acquire) == h) return NULL;
+    return &slots[h % N];
+    }
+
+  /** As front(), but sleeps until there is a full slot. Consumer 
+      only. */
+  T *wait_front (void)
+    {
+    T *slot = front();
+    if (slot) return slot;
+    pthread_mutex_lock (&lock);
+    while ((slot = front()) == NULL)
+      pthread_cond_wait (&moved, &lock);
+    pthread_mutex_unlock (&lock);
+    return slot;
+    }
+
+  /** Give the slot from front() back to the producer. Consumer only. */
+  void pop (void)
+    {
+    head.store (head.load (std::memory_order_relaxed) + 1,
+      std::memory_order_release);
+    wake();
+    }
+
+  protected:
+
+  // Wake the other thread, if it is waiting. A waiter looks at the 
+  //   ring with the lock held, so taking it here means that the wakeup
+  //   comes either before it looks, or after it has gone to sleep
+  void wake (void)
+    {
+    pthread_mutex_lock (&lock);
+    pthread_cond_broadcast (&moved);
+    pthread_mutex_unlock (&lock);
+    }
+
+  T slots[N];
+  // The number of slots ever taken by the consumer, and ever filled by
+  //   the producer. Each is written by only one thread, and they are
+  //   kept on separate cache lines so that the two threads do not slow
+  //   each other down.
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) std::atomic<size_t> tail;
+  // For a thread to sleep on, while the ring is full or empty
+  pthread_mutex_t lock;
+  pthread_cond_t moved;
+  };
+
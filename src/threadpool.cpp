@@ -0,0 +1,97 @@
+/*============================================================================
+
+  threadpool.cpp
+
+  Copyright (c)2020-1 Kevin Boone, GPL v3.0
+
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "threadpool.h"
+#include "log.h"
+
+/*===========================================================================
+
+  ThreadPool constructor
+
+===========================================================================*/
+ThreadPool::ThreadPool (int threads)
+  {
+  if (threads < 1)
+    threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  if (threads < 1)
+    threads = 1;
+  this->threads = threads;
+  job = NULL;
+  data = NULL;
+  quit = false;
+  pthread_barrier_init (&start_barrier, NULL, threads);
+  pthread_barrier_init (&end_barrier, NULL, threads);
+
+  workers = new Worker[threads];
+  // Worker 0 is whichever thread calls run()
+  for (int i = 1; i < threads; i++)
+    {
+    workers[i].pool = this;
+    workers[i].index = i;
+    pthread_create (&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+  log_debug ("Thread pool started with %d threads", threads);
+  }
+
+/*===========================================================================
+
+  ThreadPool destructor
+
+===========================================================================*/
+ThreadPool::~ThreadPool (void)
+  {
+  quit = true;
+  pthread_barrier_wait (&start_barrier);
+  for (int i = 1; i < threads; i++)
+    pthread_join (workers[i].thread, NULL);
+  delete[] workers;
+  pthread_barrier_destroy (&start_barrier);
+  pthread_barrier_destroy (&end_barrier);
+  }
+
+/*===========================================================================
+
+  ThreadPool::worker_main
+
+===========================================================================*/
+void *ThreadPool::worker_main (void *arg)
+  {
+  Worker *worker = (Worker *)arg;
+  ThreadPool *pool = worker->pool;
+  while (true)
+    {
+    pthread_barrier_wait (&pool->start_barrier);
+    if (pool->quit) break;
+    pool->job (worker->index, pool->threads, pool->data);
+    pthread_barrier_wait (&pool->end_barrier);
+    }
+  return NULL;
+  }
+
+/*===========================================================================
+
+  ThreadPool::run
+
+===========================================================================*/
+void ThreadPool::run (ThreadPoolJob job, void *data)
+  {
+  if (threads == 1)
+    {
+    job (0, 1, data);
+    return;
+    }
+  this->job = job;
+  this->data = data;
+  pthread_barrier_wait (&start_barrier);
+  job (0, threads, data);
+  pthread_barrier_wait (&end_barrier);
+  }
+
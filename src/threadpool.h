@@ -0,0 +1,58 @@
+/*============================================================================
+
+  threadpool.h
+
+  Copyright (c)2020-1 Kevin Boone, GPL v3.0
+
+  A fixed set of long-lived worker threads, which all run the same job
+  together and then wait for the next one. The thread that calls run()
+  takes part as worker 0, so a pool of one thread creates no threads
+  at all.
+
+============================================================================*/
+#pragma once
+
+#include <pthread.h>
+
+/** A job is called once on each worker, with the worker's number
+    (0 to workers-1) and the total number of workers. It is up to the
+    job to divide the work according to these numbers. */
+typedef void (*ThreadPoolJob) (int worker, int workers, void *data);
+
+class ThreadPool
+  {
+  public:
+
+  /** Create a pool with the given total number of workers, including
+      the calling thread. A value less than one means one worker per
+      online CPU. */
+  ThreadPool (int threads);
+  ~ThreadPool (void);
+
+  /** Run job on all workers, and return when they have all finished. */
+  void run (ThreadPoolJob job, void *data);
+
+  int get_threads (void) const { return threads; }
+
+  protected:
+
+  static void *worker_main (void *arg);
+
+  struct Worker
+    {
+    ThreadPool *pool;
+    int index;
+    pthread_t thread;
+    };
+
+  int threads;
+  Worker *workers;
+  // Every worker waits at start_barrier for a job, and at end_barrier
+  //   when it has done its part
+  pthread_barrier_t start_barrier;
+  pthread_barrier_t end_barrier;
+  ThreadPoolJob job;
+  void *data;
+  bool quit;
+  };
+